@@ -0,0 +1,364 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include "lobera_codec.hpp"
+#include "lobera_mirror.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_sim.hpp"
+#include "lobera_simd.hpp"
+#include "lobera_store.hpp"
+
+//
+// Codec and end-to-end benchmarks.
+//
+// Each result is a JSON object on its own line:
+//   {"name": ..., "params": ..., "iterations": N, "ns_per_op": ..., "ops_per_s": ...,
+//    "allocs_per_op": ..., "device_ms_per_op": ...}
+// allocs_per_op counts heap allocations after the warm-up call.
+// device_ms_per_op is the simulated device time (transfers and pacing),
+// it's 0 for codec benchmarks and for end-to-end runs with pacing disabled.
+//
+// Usage: bench [name filter]
+//
+
+#define BENCH_MIN_NS      200000000ull
+#define BENCH_MAX_ITERS   1000000ull
+
+namespace
+{
+    std::string filter;
+    volatile size_t sink;
+    size_t allocations = 0;
+    double allocs_per_op = 0;
+
+    void report(std::string const & name, std::string const & params, size_t iterations, double ns_per_op, double device_ms_per_op)
+    {
+        std::cout << "{\"name\": \"" << name << "\""
+                  << ", \"params\": \"" << params << "\""
+                  << ", \"iterations\": " << iterations
+                  << ", \"ns_per_op\": " << ns_per_op
+                  << ", \"ops_per_s\": " << (ns_per_op > 0 ? 1e9 / ns_per_op : 0)
+                  << ", \"allocs_per_op\": " << allocs_per_op
+                  << ", \"device_ms_per_op\": " << device_ms_per_op
+                  << "}" << std::endl;
+    }
+
+    bool selected(std::string const & name)
+    {
+        return filter.empty() || (name.find(filter) != std::string::npos);
+    }
+
+    // Runs f until enough time is spent, returns ns per call
+    double measure(std::function<void()> const & f, size_t max_iters, size_t & iterations)
+    {
+        f(); // warm up
+
+        size_t start_allocations = allocations;
+        auto start = std::chrono::steady_clock::now();
+        uint64_t elapsed = 0;
+        for (iterations = 0; (iterations < max_iters) && ((iterations == 0) || (elapsed < BENCH_MIN_NS)); )
+        {
+            f();
+            ++iterations;
+            elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+        allocs_per_op = static_cast<double>(allocations - start_allocations) / iterations;
+        return static_cast<double>(elapsed) / iterations;
+    }
+
+    void bench_codec(std::string const & name, std::string const & params, std::function<void()> const & f)
+    {
+        if (!selected(name))
+            return;
+        size_t iterations = 0;
+        double ns = measure(f, BENCH_MAX_ITERS, iterations);
+        report(name, params, iterations, ns, 0);
+    }
+
+    // Runs op on a fresh simulator, setup isn't timed
+    void bench_device(std::string const & name,
+                      std::string const & params,
+                      std::function<void(lobera_sim &)> const & setup,
+                      std::function<void(lobera_sim &)> const & op)
+    {
+        if (!selected(name))
+            return;
+
+        for (bool pacing: {true, false})
+        {
+            lobera_sim l(pacing);
+            setup(l);
+            l.idle(60000);
+            l.reset_stats();
+
+            size_t iterations = 0;
+            double ns = measure([&] { op(l); }, 1000, iterations);
+            double device_ms = static_cast<double>(l.elapsed_ms()) / (iterations + 1);
+            report(name, params + (pacing ? " pacing=on" : " pacing=off"), iterations, ns, device_ms);
+        }
+    }
+
+    //
+    // Inputs
+    //
+    lobera_usb::macro make_macro(size_t entries)
+    {
+        lobera_usb::macro m;
+        for (size_t i = 0; i < entries; ++i)
+        {
+            switch (i % 4)
+            {
+                case 0: m.push_back(lobera_usb::macro_entry::key_dn(0x04 + i % 26)); break;
+                case 1: m.push_back(lobera_usb::macro_entry::sleep(50));             break;
+                case 2: m.push_back(lobera_usb::macro_entry::key_up(0x04 + i % 26)); break;
+                case 3: m.push_back(lobera_usb::macro_entry::repeat(3));             break;
+            }
+        }
+        return m;
+    }
+
+    // keys with macros of `entries` entries, or substitutions if 0
+    lobera_usb::keys_settings make_keys(size_t keys, size_t entries)
+    {
+        lobera_usb::keys_settings settings;
+        for (size_t key = 1; key <= keys; ++key)
+        {
+            if (entries == 0)
+                settings.emplace(key, lobera_usb::key_setting(0x04 + key % 26, lobera_usb::repeat_mode::PRESS));
+            else
+                settings.emplace(key, lobera_usb::key_setting(make_macro(entries)));
+        }
+        return settings;
+    }
+
+    std::string keys_params(size_t keys, size_t entries)
+    {
+        return "keys=" + std::to_string(keys) + " macro_entries=" + std::to_string(entries);
+    }
+}
+
+void bench_simd()
+{
+    std::vector<uint8_t> a(BATCH_SIZE, 0), b(BATCH_SIZE, 0);
+    std::string params = std::string("size=4096 impl=") + lobera_simd::implementation();
+
+    bench_codec("simd_first_difference", params, [&] {
+        sink = lobera_simd::first_difference(a.data(), b.data(), a.size());
+    });
+    bench_codec("simd_all_zero", params, [&] {
+        sink = lobera_simd::all_zero(a.data(), a.size());
+    });
+
+    std::vector<uint8_t> macro(THUMB_MAX_MACRO, 0);
+    lobera_codec::encode_macro_entries(make_macro(300), macro.data(), macro.size());
+    bench_codec("simd_find_zero_record", std::string("size=1024 stride=3 impl=") + lobera_simd::implementation(), [&] {
+        sink = lobera_simd::find_zero_record(macro.data(), macro.size(), 3);
+    });
+}
+
+void bench_macro_codec()
+{
+    for (size_t entries: {3, 32, 341})
+    {
+        lobera_usb::macro m = make_macro(entries);
+        uint8_t data[THUMB_MAX_MACRO] = {0};
+        std::string params = "entries=" + std::to_string(entries);
+        lobera_codec::encode_macro_entries(m, data, sizeof(data)); // decode input, even if encode is filtered out
+
+        bench_codec("encode_macro", params, [&] {
+            sink = lobera_codec::encode_macro_entries(m, data, sizeof(data));
+        });
+        bench_codec("decode_macro", params, [&] {
+            sink = lobera_codec::decode_macro_entries(data, sizeof(data)).size();
+        });
+    }
+}
+
+void bench_tables_codec()
+{
+    for (size_t keys: {1, 57, 114})
+    {
+        lobera_usb::keys_settings settings = make_keys(keys, 5);
+        uint8_t offsets[OFFSETS_SIZE] = {0};
+        uint8_t repeats[REPEAT_SIZE] = {0};
+        std::string params = "keys=" + std::to_string(keys);
+        lobera_codec::encode_offset_entries(settings, offsets, sizeof(offsets));
+        lobera_codec::encode_repeat_entries(settings, repeats, sizeof(repeats));
+
+        bench_codec("encode_offsets", params, [&] {
+            lobera_codec::encode_offset_entries(settings, offsets, sizeof(offsets));
+            sink = offsets[4];
+        });
+        bench_codec("decode_offsets", params, [&] {
+            sink = lobera_codec::decode_offset_entries(offsets, sizeof(offsets)).size();
+        });
+        bench_codec("encode_repeats", params, [&] {
+            lobera_codec::encode_repeat_entries(settings, repeats, sizeof(repeats));
+            sink = repeats[0];
+        });
+        bench_codec("decode_repeats", params, [&] {
+            sink = lobera_codec::decode_repeat_entries(repeats, sizeof(repeats)).size();
+        });
+    }
+}
+
+void bench_profile_codec()
+{
+    // 114 keys: substitutions, short macros, macros filling the 64K data limit
+    for (size_t entries: {0, 5, 190})
+    {
+        lobera_usb::keys_settings settings = make_keys(114, entries);
+        lobera_usb::profile_image image = lobera_usb::compile_profile_image(settings);
+        std::string params = keys_params(114, entries);
+
+        bench_codec("compile_profile_image", params, [&] {
+            sink = lobera_usb::compile_profile_image(settings).data.size();
+        });
+        bench_codec("decode_profile_image", params, [&] {
+            sink = lobera_usb::decode_profile_image(image).size();
+        });
+    }
+}
+
+void bench_profile_store()
+{
+    // Startup of an agent: open the library and find one profile, against
+    // decoding it from a stored image
+    for (size_t profiles: {100, 5000})
+    {
+        lobera_profile_store_builder builder;
+        lobera_usb::profile_image image = lobera_usb::compile_profile_image(make_keys(114, 5));
+        for (size_t i = 0; i < profiles; ++i)
+            builder.add("profile" + std::to_string(i), image);
+        std::string path = "/tmp/lobera_bench_store." + std::to_string(profiles);
+        builder.save(path);
+
+        std::string params = "profiles=" + std::to_string(profiles);
+        std::string name = "profile" + std::to_string(profiles / 2);
+        bench_codec("store_open_find", params, [&] {
+            lobera_profile_store store(path);
+            lobera_profile_store::entry e;
+            sink = store.find(name, e) ? e.image.data_size : 0;
+        });
+        std::remove(path.c_str());
+    }
+}
+
+void bench_mirror()
+{
+    // Reader refresh check against loading the shared pointer every time,
+    // publish copies the snapshot but shares the key maps
+    lobera_mirror mirror;
+    auto keys = std::make_shared<lobera_usb::keys_settings const>(make_keys(114, 5));
+    mirror.update([&](lobera_mirror::snapshot & s) { s.keys.fill(keys); });
+
+    lobera_mirror::reader r(mirror);
+    bench_codec("mirror_read", "reader", [&] { sink = r.get().profile; });
+    bench_codec("mirror_read", "current", [&] { sink = mirror.current()->profile; });
+    bench_codec("mirror_publish", "profiles=5 keys=114", [&] {
+        mirror.update([](lobera_mirror::snapshot & s) { s.profile = s.profile % 5 + 1; });
+    });
+}
+
+void bench_device_ops()
+{
+    for (size_t entries: {0, 190})
+    {
+        lobera_usb::keys_settings settings = make_keys(114, entries);
+        std::string params = keys_params(114, entries);
+
+        bench_device("set_profile_buttons", params,
+            [](lobera_sim &) {},
+            [&](lobera_sim & l) { l.set_profile_buttons(2, settings); });
+        bench_device("get_profile_buttons", params,
+            [&](lobera_sim & l) { l.set_profile_buttons(2, settings); },
+            [&](lobera_sim & l) { sink = l.get_profile_buttons(2).size(); });
+    }
+
+    lobera_usb::macro m = make_macro(32);
+    bench_device("set_thumb_macro", "entries=32",
+        [](lobera_sim &) {},
+        [&](lobera_sim & l) { l.set_thumb_macro(1, 2, m); });
+
+    // Mostly clean device: one profile with keys, one color changed
+    auto dirty = [](lobera_sim & l) {
+        l.set_profile_buttons(2, make_keys(2, 0));
+        l.set_profile_color(3, 0x123456);
+    };
+    bench_device("reset_config", "force=1", dirty, [](lobera_sim & l) { l.reset_config(true); });
+    // Timed op dirties the device again, so device time is the reset plus
+    // restoring the dirty state: ~12.0 s, of which the reset is ~6.0 s
+    bench_device("reset_config", "force=0 mostly_clean=1", dirty, [&](lobera_sim & l) {
+        l.reset_config();
+        dirty(l);
+    });
+}
+
+void bench_apply_profiles()
+{
+    lobera_usb::macro const m = make_macro(3);
+
+    std::vector<lobera_usb::profile_config> config;
+    for (uint8_t profile = 1; profile <= 5; ++profile)
+    {
+        lobera_usb::profile_config c;
+        c.profile = profile;
+        for (uint8_t key = 0x04; key < 0x04 + 20; ++key)
+            c.keys.emplace(key, lobera_usb::key_setting(m));
+        c.thumbs = {m, m, lobera_usb::macro{}};
+        config.push_back(c);
+    }
+
+    bench_device("apply_sequential", "profiles=5 verify=1", [](lobera_sim &) {}, [&](lobera_sim & l) {
+        for (auto const & c: config)
+        {
+            l.set_profile_buttons(c.profile, c.keys);
+            for (uint8_t thumb = 1; thumb <= 3; ++thumb)
+                l.set_thumb_macro(c.profile, thumb, c.thumbs[thumb - 1]);
+            l.get_profile_buttons(c.profile);
+            for (uint8_t thumb = 1; thumb <= 3; ++thumb)
+                l.get_thumb_macro(c.profile, thumb);
+        }
+    });
+    bench_device("apply_profiles", "profiles=5 verify=1", [](lobera_sim &) {}, [&](lobera_sim & l) {
+        sink = l.apply_profiles(config).transfers.size();
+    });
+}
+
+void * operator new(size_t size)
+{
+    ++allocations;
+    if (void * p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+    std::free(p);
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc > 1)
+        filter = argv[1];
+
+    bench_simd();
+    bench_macro_codec();
+    bench_tables_codec();
+    bench_profile_codec();
+    bench_profile_store();
+    bench_mirror();
+    bench_device_ops();
+    bench_apply_profiles();
+    return 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+#include "lobera_codec.hpp"
+#include "lobera_protocol.hpp"
+
+//
+// Per-instance buffers, sized once for the largest profile and reused by
+// every call, so repeated operations don't allocate
+//
+struct lobera_arena
+{
+    lobera_usb::profile_image                 image;     // profile being read or compiled
+    std::vector<lobera_codec::offset_entry>   offsets;   // decoded tables
+    std::vector<lobera_codec::repeat_entry>   repeats;
+    std::vector<uint8_t>                      key_data;  // set_key() encoded key
+    std::vector<uint8_t>                      patch;     // set_key() touched batches
+    uint8_t                                   block[BATCH_SIZE]; // thumbs block, scratch reads
+
+    lobera_arena()
+    {
+        image.offsets.reserve(OFFSETS_SIZE);
+        image.data.reserve(lobera_codec::calc_num_batches(MAX_DATA_SIZE) * BATCH_SIZE);
+        image.repeats.reserve(REPEAT_SIZE);
+        offsets.reserve(MAX_KEYS + 1);
+        repeats.reserve(MAX_KEYS + 1);
+        key_data.reserve(MAX_DATA_SIZE);
+        patch.reserve(lobera_codec::calc_num_batches(MAX_DATA_SIZE) * BATCH_SIZE);
+    }
+};
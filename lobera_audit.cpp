@@ -0,0 +1,276 @@
+#include "lobera_audit.hpp"
+#include "lobera_arena.hpp"
+#include "lobera_codec.hpp"
+#include "lobera_hash.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_simd.hpp"
+#include "lobera_trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+
+namespace
+{
+    //
+    // Canonical form: records in table order, each as key, repeat mode,
+    // record type and length, then the bytes it references. Disabled keys
+    // hash the same whatever code >= KEY_CODE_DISABLE the device holds.
+    //
+    uint64_t hash_tables(std::vector<lobera_codec::offset_entry> const & offsets,
+                         std::vector<lobera_codec::repeat_entry> const & repeats)
+    {
+        fnv1a h;
+        for (size_t i = 0; i < offsets.size(); ++i)
+        {
+            h.add(repeats[i].key);
+            h.add(static_cast<uint8_t>(repeats[i].mode));
+            h.add(static_cast<uint8_t>(offsets[i].op));
+            h.add16(offsets[i].len);
+        }
+        return h.h;
+    }
+
+    uint64_t hash_data(std::vector<lobera_codec::offset_entry> const & offsets, uint8_t const * data, size_t data_size)
+    {
+        fnv1a h;
+        for (auto const & offset: offsets)
+        {
+            if (static_cast<size_t>(offset.offset) + offset.len > data_size)
+                throw std::runtime_error("Invalid data retrieved");
+            if (offset.op == lobera_codec::offset_entry::type::OF_SUBST)
+                h.add(std::min<uint8_t>(data[offset.offset], KEY_CODE_DISABLE));
+            else
+                h.add(data + offset.offset, offset.len);
+        }
+        return h.h;
+    }
+
+    // Macro bytes of enabled thumbs, up to the terminator
+    uint64_t hash_thumbs(uint8_t const * enabled, uint8_t const * block)
+    {
+        fnv1a h;
+        for (size_t ithumb = 0; ithumb < 3; ++ithumb)
+        {
+            h.add(enabled[ithumb] ? 1 : 0);
+            if (!enabled[ithumb])
+                continue;
+            uint8_t const * macro = block + ithumb * THUMB_MAX_MACRO;
+            size_t len = lobera_simd::find_zero_record(macro, THUMB_MAX_MACRO, 3);
+            h.add16(len);
+            h.add(macro, len);
+        }
+        return h.h;
+    }
+
+    struct golden_profile
+    {
+        lobera_usb::profile_config const * config;
+        lobera_usb::profile_fingerprint    fingerprint;
+    };
+
+    void explain_drift(lobera_usb & l, golden_profile const & golden, lobera_profile_drift & drift)
+    {
+        if (drift.keys)
+        {
+            lobera_usb::keys_settings const actual = l.get_profile_buttons(golden.config->profile);
+            std::set<uint8_t> keys;
+            for (auto const & key: actual)
+                keys.insert(key.first);
+            for (auto const & key: golden.config->keys)
+                keys.insert(key.first);
+            for (uint8_t key: keys)
+            {
+                auto ia = actual.find(key), ig = golden.config->keys.find(key);
+                if ((ia == actual.end()) || (ig == golden.config->keys.end()) || !(ia->second == ig->second))
+                    drift.keys_differ.push_back(key);
+            }
+        }
+        if (drift.thumbs)
+        {
+            for (uint8_t ithumb = 1; ithumb <= 3; ++ithumb)
+            {
+                if (!(l.get_thumb_macro(golden.config->profile, ithumb) == golden.config->thumbs[ithumb - 1]))
+                    drift.thumbs_differ.push_back(ithumb);
+            }
+        }
+    }
+
+    lobera_device_audit audit_device(std::string                 const & device,
+                                     std::vector<golden_profile> const & golden,
+                                     lobera_audit_options        const & options)
+    {
+        lobera_device_audit audit;
+        audit.device = device;
+        auto start = std::chrono::steady_clock::now();
+
+        try
+        {
+            std::unique_ptr<lobera_usb> l;
+            if (options.open)
+                l = options.open(device);
+            else
+            {
+                l.reset(new lobera_usb());
+                l->open(device);
+            }
+
+            for (auto const & g: golden)
+            {
+                lobera_usb::profile_fingerprint fp = l->read_profile_fingerprint(g.config->profile, &g.fingerprint);
+                if (fp == g.fingerprint)
+                    continue;
+
+                lobera_profile_drift drift;
+                drift.profile = g.config->profile;
+                drift.keys    = (fp.tables != g.fingerprint.tables) || (fp.data != g.fingerprint.data);
+                drift.thumbs  = (fp.thumbs != g.fingerprint.thumbs);
+                if (options.explain)
+                    explain_drift(*l, g, drift);
+                audit.drift.push_back(std::move(drift));
+            }
+
+            if (!options.colors.empty())
+            {
+                std::array<uint32_t, 6> colors = l->get_profile_colors();
+                audit.colors = !std::equal(colors.begin(), colors.end(), options.colors.begin(), options.colors.end());
+            }
+        }
+        catch (std::exception const & e)
+        {
+            audit.error = e.what();
+        }
+
+        audit.duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        return audit;
+    }
+}
+
+lobera_usb::profile_fingerprint lobera_usb::fingerprint_profile(profile_config const & config)
+{
+    if ((config.profile < 1) || (config.profile > 5))
+        throw std::runtime_error("Invalid profile number");
+
+    profile_image image = compile_profile_image(config.keys);
+    std::vector<lobera_codec::offset_entry> offsets = lobera_codec::decode_offset_entries(image.offsets.data(), image.offsets.size());
+    std::vector<lobera_codec::repeat_entry> repeats = lobera_codec::decode_repeat_entries(image.repeats.data(), image.repeats.size());
+
+    uint8_t enabled[3] = {0};
+    std::vector<uint8_t> block(BATCH_SIZE, 0);
+    for (size_t ithumb = 0; ithumb < 3; ++ithumb)
+    {
+        if (lobera_codec::encode_macro_entries(config.thumbs[ithumb], nullptr, 0) > THUMB_MAX_MACRO)
+            throw std::runtime_error("Macro is too large");
+        enabled[ithumb] = config.thumbs[ithumb].empty() ? 0 : 1;
+        lobera_codec::encode_macro_entries(config.thumbs[ithumb], block.data() + ithumb * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+    }
+
+    profile_fingerprint fp;
+    fp.tables = hash_tables(offsets, repeats);
+    fp.data   = hash_data(offsets, image.data.data(), image.data.size());
+    fp.thumbs = hash_thumbs(enabled, block.data());
+    return fp;
+}
+
+lobera_usb::profile_fingerprint lobera_usb::read_profile_fingerprint(uint8_t profile, profile_fingerprint const * expected)
+{
+    LOBERA_TRACE_OP("read_profile_fingerprint");
+    if ((profile < 1) || (profile > 5))
+        throw std::runtime_error("Invalid profile number");
+    pacing_hold hold(*this);
+
+    profile_image & image = arena_->image;
+    profile_fingerprint fp;
+
+    // Tables
+    image.offsets.assign(OFFSETS_SIZE, 0);
+    size_t sz = read_data(R_KEYS_OFFSETS, 0, profile, image.offsets.data(), image.offsets.size());
+    if ((sz != image.offsets.size()) || ((image.offsets[0] != 0x72) && (image.offsets[0] != 0x00)))
+        throw std::runtime_error("Invalid data retrieved");
+    image.repeats.assign(REPEAT_SIZE, 0);
+    sz = read_data(R_KEYS_REPEATS, 0, profile, image.repeats.data(), image.repeats.size());
+    if (sz != image.repeats.size())
+        throw std::runtime_error("Invalid data retrieved");
+
+    lobera_codec::try_decode_offset_entries(image.offsets.data(), image.offsets.size(), arena_->offsets).value();
+    lobera_codec::try_decode_repeat_entries(image.repeats.data(), image.repeats.size(), arena_->repeats).value();
+    if (arena_->offsets.size() != arena_->repeats.size())
+        throw std::runtime_error("Invalid data retrieved");
+    fp.tables = hash_tables(arena_->offsets, arena_->repeats);
+
+    // Data batches the tables reference, dead space isn't read
+    if ((expected == nullptr) || (fp.tables == expected->tables))
+    {
+        size_t data_size = image.offsets[3] * 0x100 + image.offsets[4];
+        size_t num_batches = lobera_codec::calc_num_batches(data_size);
+        bool used[MAX_DATA_SIZE / BATCH_SIZE + 1] = {false};
+        for (auto const & offset: arena_->offsets)
+        {
+            if ((offset.len == 0) || (static_cast<size_t>(offset.offset) + offset.len > num_batches * BATCH_SIZE))
+                throw std::runtime_error("Invalid data retrieved");
+            for (size_t batch = offset.offset / BATCH_SIZE; batch <= (offset.offset + offset.len - 1u) / BATCH_SIZE; ++batch)
+                used[batch] = true;
+        }
+
+        image.data.assign(num_batches * BATCH_SIZE, 0);
+        for (size_t batch_num = 0; batch_num < num_batches; ++batch_num)
+        {
+            if (!used[batch_num])
+                continue;
+            uint16_t index = (batch_num << 8) | profile;
+            sz = read_data(R_KEYS_DATA, 0, index, image.data.data() + batch_num * BATCH_SIZE, BATCH_SIZE);
+            if (sz != BATCH_SIZE)
+                throw std::runtime_error("Invalid data retrieved");
+        }
+        fp.data = hash_data(arena_->offsets, image.data.data(), image.data.size());
+    }
+
+    // Thumbs, the block is only read if some are enabled
+    uint8_t enabled[3] = {0};
+    for (uint16_t ithumb = 1; ithumb <= 3; ++ithumb)
+    {
+        sz = read_data(R_THUMB_ENABLED, ithumb, profile, enabled + ithumb - 1, 1);
+        if (sz != 1)
+            throw std::runtime_error("Invalid data retrieved");
+    }
+    if (enabled[0] || enabled[1] || enabled[2])
+    {
+        sz = read_data(R_THUMBS_MACROS, 0, profile, arena_->block, BATCH_SIZE);
+        if (sz != BATCH_SIZE)
+            throw std::runtime_error("Invalid data retrieved");
+    }
+    fp.thumbs = hash_thumbs(enabled, arena_->block);
+
+    return fp;
+}
+
+std::vector<lobera_device_audit> audit_fleet(std::vector<std::string>                const & devices,
+                                             std::vector<lobera_usb::profile_config> const & golden,
+                                             lobera_audit_options                    const & options)
+{
+    if (!options.colors.empty() && (options.colors.size() != 6))
+        throw std::runtime_error("Golden colors must have 6 entries");
+
+    // Golden fingerprints are computed once for the whole fleet
+    std::vector<golden_profile> expected;
+    for (auto const & config: golden)
+        expected.push_back(golden_profile{&config, lobera_usb::fingerprint_profile(config)});
+
+    std::vector<lobera_device_audit> results(devices.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+        for (size_t i = next++; i < devices.size(); i = next++)
+            results[i] = audit_device(devices[i], expected, options);
+    };
+
+    size_t num_threads = std::max<size_t>(1, std::min(options.threads, devices.size()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto & thread: threads)
+        thread.join();
+
+    return results;
+}
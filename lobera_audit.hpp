@@ -0,0 +1,48 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+#include <memory>
+
+//
+// Fleet drift audit: compares many keyboards against a golden configuration
+// using profile fingerprints, one device per worker thread. Full settings are
+// only read back to explain a mismatch.
+//
+
+struct lobera_profile_drift
+{
+    uint8_t              profile;
+    bool                 keys   = false;    // keys tables or data differ
+    bool                 thumbs = false;    // thumb macros differ
+    std::vector<uint8_t> keys_differ;       // with explain: keys missing, extra or changed
+    std::vector<uint8_t> thumbs_differ;     // with explain: thumb buttons that differ
+};
+
+struct lobera_device_audit
+{
+    std::string                       device;
+    std::vector<lobera_profile_drift> drift;          // only profiles that differ
+    bool                              colors = false; // profile colors differ
+    std::string                       error;          // device couldn't be audited
+    uint64_t                          duration_ms = 0;
+
+    bool ok() const
+    {   return error.empty() && drift.empty() && !colors;   }
+};
+
+struct lobera_audit_options
+{
+    size_t                threads = 8;
+    bool                  explain = false;  // read back full settings of drifted profiles
+    std::vector<uint32_t> colors;           // golden colors (6), empty to skip the check
+
+    // Opens a device by id, defaults to lobera_usb::open(device)
+    std::function<std::unique_ptr<lobera_usb>(std::string const & device)> open;
+};
+
+// Audits devices (ids from lobera_usb::list_devices()) against the golden
+// profiles, results are in the order of devices
+std::vector<lobera_device_audit> audit_fleet(std::vector<std::string>                const & devices,
+                                             std::vector<lobera_usb::profile_config> const & golden,
+                                             lobera_audit_options                    const & options = lobera_audit_options());
@@ -0,0 +1,783 @@
+#include "lobera_codec.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_simd.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+namespace lobera_codec
+{
+    //
+    // Repeats block
+    //
+    lobera_result<size_t> try_decode_repeat_entry(uint8_t const * data, size_t data_size, size_t p, repeat_entry & entry) noexcept
+    {
+        if ((data_size - p) < 2)
+            return lobera_errc::BROKEN_REPEATS;
+
+        uint8_t key = data[p];
+        if (key == 0)
+            return 0;
+
+        lobera_usb::repeat_mode mode = static_cast<lobera_usb::repeat_mode>(data[p + 1]);
+        switch (mode)
+        {
+            case lobera_usb::repeat_mode::SINGLE:
+            case lobera_usb::repeat_mode::PRESS:
+            case lobera_usb::repeat_mode::NEXT:
+                entry.key = data[p];
+                entry.mode = mode;
+                return 2;
+        }
+        return lobera_result<size_t>(lobera_errc::UNKNOWN_REPEAT_MODE, data[p + 1]);
+    }
+
+    size_t decode_repeat_entry(uint8_t const * data, size_t data_size, size_t p, repeat_entry & entry)
+    {
+        return try_decode_repeat_entry(data, data_size, p, entry).value();
+    }
+
+    size_t encode_repeat_entry(lobera_usb::keys_settings::value_type      const & entry,
+                               uint8_t                                           * data,
+                               size_t                                              data_size,
+                               size_t                                              p)
+    {
+        using setting_type = lobera_usb::key_setting::type;
+
+        switch (entry.second.get_type())
+        {
+            case setting_type::DISABLE:
+            case setting_type::SUBST:
+            case setting_type::MACRO:
+                if (data != nullptr)
+                {
+                    if ((data_size - p) < 2)
+                        return 0;
+                    data[p++] = entry.first;
+                    data[p++] = static_cast<uint8_t>(entry.second.get_repeat_mode());
+                }
+                return 2;
+        }
+        throw std::runtime_error("Unknown key setting type: " + std::to_string(static_cast<unsigned>(entry.second.get_type())));
+    }
+
+    lobera_result<void> try_decode_repeat_entries(uint8_t const * data, size_t data_size, std::vector<repeat_entry> & entries) noexcept
+    {
+        // Records are fixed size, the terminator bounds the loop and the vector
+        size_t end = lobera_simd::find_zero_record(data, data_size, 2);
+
+        entries.clear();
+        try
+        {
+            entries.reserve(end / 2);
+        }
+        catch (std::bad_alloc const &)
+        {
+            return lobera_errc::OUT_OF_MEMORY;
+        }
+        for (size_t p = 0; p < end; )
+        {
+            repeat_entry entry;
+            auto sz = try_decode_repeat_entry(data, data_size, p, entry);
+            if (!sz)
+                return sz.error();
+            if (*sz == 0)
+                break;
+            p += *sz;
+            entries.push_back(entry);
+        }
+        return {};
+    }
+
+    lobera_result<std::vector<repeat_entry>> try_decode_repeat_entries(uint8_t const * data, size_t data_size) noexcept
+    {
+        std::vector<repeat_entry> entries;
+        auto ret = try_decode_repeat_entries(data, data_size, entries);
+        if (!ret)
+            return ret.error();
+        return entries;
+    }
+
+    std::vector<repeat_entry> decode_repeat_entries(uint8_t const * data, size_t data_size)
+    {
+        return try_decode_repeat_entries(data, data_size).value();
+    }
+
+    void encode_repeat_entries(lobera_usb::keys_settings const & entries, uint8_t * data, size_t data_size)
+    {
+        size_t p = 0;
+        for (auto const & entry: entries)
+            p += encode_repeat_entry(entry, data, data_size, p);
+        for (; p < data_size - 1; )
+        {
+            data[p++] = 0x00;
+            data[p++] = 0x01;
+        }
+    }
+
+    lobera_result<void> try_encode_repeat_table(std::vector<repeat_entry> const & entries, uint8_t * data, size_t data_size) noexcept
+    {
+        if (entries.size() * 2 > data_size)
+            return lobera_errc::TOO_MANY_KEYS;
+
+        size_t p = 0;
+        for (auto const & entry: entries)
+        {
+            data[p++] = entry.key;
+            data[p++] = static_cast<uint8_t>(entry.mode);
+        }
+        for (; p < data_size - 1; )
+        {
+            data[p++] = 0x00;
+            data[p++] = 0x01;
+        }
+        return {};
+    }
+
+    void encode_repeat_table(std::vector<repeat_entry> const & entries, uint8_t * data, size_t data_size)
+    {
+        try_encode_repeat_table(entries, data, data_size).value();
+    }
+
+    //
+    // Macro
+    //
+    lobera_result<size_t> try_decode_macro_entry(uint8_t const * data, size_t data_size, size_t p, lobera_usb::macro_entry & entry) noexcept
+    {
+        switch (data[p])
+        {
+            case 0x00:
+                return 0;
+
+            case 0x84:
+                if ((data_size - p) < 3)
+                    return lobera_errc::BROKEN_MACRO;
+                entry = data[p + 2]
+                    ? lobera_usb::macro_entry::key_dn(data[p + 1])
+                    : lobera_usb::macro_entry::key_up(data[p + 1]);
+                return 3;
+
+            case 0x86:
+                if ((data_size - p) < 3)
+                    return lobera_errc::BROKEN_MACRO;
+                entry = lobera_usb::macro_entry::repeat(data[p + 1] * 0x100 + data[p + 2]);
+                return 3;
+
+            case 0x87:
+                if ((data_size - p) < 3)
+                    return lobera_errc::BROKEN_MACRO;
+                entry = lobera_usb::macro_entry::sleep(data[p + 1] * 0x100 + data[p + 2]);
+                return 3;
+        }
+        return lobera_result<size_t>(lobera_errc::UNKNOWN_MACRO_CODE, data[p]);
+    }
+
+    size_t decode_macro_entry(uint8_t const * data, size_t data_size, size_t p, lobera_usb::macro_entry & entry)
+    {
+        return try_decode_macro_entry(data, data_size, p, entry).value();
+    }
+
+    lobera_result<size_t> try_encode_macro_entry(lobera_usb::macro_entry const & entry, uint8_t * data, size_t data_size, size_t p) noexcept
+    {
+        using macro_type = lobera_usb::macro_entry::type;
+
+        switch (entry.get_type())
+        {
+            case macro_type::KEY_DN:
+            case macro_type::KEY_UP:
+                if (data != nullptr)
+                {
+                    if ((data_size - p) < 3)
+                        return lobera_errc::MACRO_TOO_LARGE;
+                    data[p++] = 0x84;
+                    data[p++] = *entry.try_get_key_code();
+                    data[p++] = (entry.get_type() == macro_type::KEY_DN) ? 1 : 0;
+                }
+                return 3;
+
+            case macro_type::REPEAT:
+                if (data != nullptr)
+                {
+                    if ((data_size - p) < 3)
+                        return lobera_errc::MACRO_TOO_LARGE;
+                    data[p++] = 0x86;
+                    data[p++] = *entry.try_get_repeat() >> 8;
+                    data[p++] = *entry.try_get_repeat() & 0xff;
+                }
+                return 3;
+
+            case macro_type::SLEEP:
+                if (data != nullptr)
+                {
+                    if ((data_size - p) < 3)
+                        return lobera_errc::MACRO_TOO_LARGE;
+                    data[p++] = 0x87;
+                    data[p++] = *entry.try_get_delay() >> 8;
+                    data[p++] = *entry.try_get_delay() & 0xff;
+                }
+                return 3;
+
+            case macro_type::NONE:
+                return lobera_result<size_t>(lobera_errc::INVALID_MACRO_OPERATION, static_cast<int32_t>(entry.get_type()));
+        }
+        return lobera_result<size_t>(lobera_errc::INVALID_MACRO_OPERATION, static_cast<int32_t>(entry.get_type()));
+    }
+
+    size_t encode_macro_entry(lobera_usb::macro_entry const & entry, uint8_t * data, size_t data_size, size_t p)
+    {
+        return try_encode_macro_entry(entry, data, data_size, p).value();
+    }
+
+    lobera_result<lobera_usb::macro> try_decode_macro_entries(uint8_t const * data, size_t data_size) noexcept
+    {
+        size_t end = lobera_simd::find_zero_record(data, data_size, 3);
+
+        lobera_usb::macro ret;
+        try
+        {
+            ret.reserve((end + 2) / 3);
+        }
+        catch (std::bad_alloc const &)
+        {
+            return lobera_errc::OUT_OF_MEMORY;
+        }
+        for (size_t p = 0; p < end; )
+        {
+            lobera_usb::macro_entry entry;
+            auto sz = try_decode_macro_entry(data, data_size, p, entry);
+            if (!sz)
+                return sz.error();
+            if (*sz == 0)
+                break;
+            p += *sz;
+            ret.push_back(entry);
+        }
+        return ret;
+    }
+
+    lobera_usb::macro decode_macro_entries(uint8_t const * data, size_t data_size)
+    {
+        return try_decode_macro_entries(data, data_size).value();
+    }
+
+    lobera_result<size_t> try_encode_macro_entries(lobera_usb::macro const & entries, uint8_t * data, size_t data_size) noexcept
+    {
+        size_t p = 0;
+        for (auto const & entry: entries)
+        {
+            auto sz = try_encode_macro_entry(entry, data, data_size, p);
+            if (!sz)
+                return sz.error();
+            if (*sz == 0)
+                return lobera_errc::MACRO_TOO_LARGE;
+            p += *sz;
+        }
+        return p;
+    }
+
+    size_t encode_macro_entries(lobera_usb::macro const & entries, uint8_t * data, size_t data_size)
+    {
+        return try_encode_macro_entries(entries, data, data_size).value();
+    }
+
+    //
+    // Keys
+    //
+    lobera_result<lobera_usb::key_setting> try_decode_key_setting(uint8_t                 const * data,
+                                                                  size_t                          data_size,
+                                                                  offset_entry            const & offset,
+                                                                  lobera_usb::repeat_mode         repeat) noexcept
+    {
+        if (offset.op == offset_entry::type::OF_SUBST)
+        {
+            if (offset.offset >= data_size)
+                return lobera_errc::BROKEN_OFFSETS;
+            uint8_t key = data[offset.offset];
+            if (key >= KEY_CODE_DISABLE)
+                return lobera_usb::key_setting(repeat);
+            else
+                return lobera_usb::key_setting(key, repeat);
+        } else
+        if (offset.op == offset_entry::type::OF_MACRO)
+        {
+            if (static_cast<size_t>(offset.offset) + offset.len > data_size)
+                return lobera_errc::BROKEN_OFFSETS;
+            auto macro = try_decode_macro_entries(data + offset.offset, offset.len);
+            if (!macro)
+                return macro.error();
+            return lobera_usb::key_setting(std::move(*macro), repeat);
+        }
+        return lobera_result<lobera_usb::key_setting>(lobera_errc::UNKNOWN_RECORD_TYPE, static_cast<int32_t>(offset.op));
+    }
+
+    lobera_usb::key_setting decode_key_setting(uint8_t                 const * data,
+                                               size_t                          data_size,
+                                               offset_entry            const & offset,
+                                               lobera_usb::repeat_mode         repeat)
+    {
+        return try_decode_key_setting(data, data_size, offset, repeat).value();
+    }
+
+    lobera_result<size_t> try_encode_key_setting(lobera_usb::key_setting const & setting, uint8_t * data, size_t data_size, size_t p) noexcept
+    {
+        using setting_type = lobera_usb::key_setting::type;
+
+        switch (setting.get_type())
+        {
+            case setting_type::DISABLE:
+                if (data != nullptr)
+                    data[p] = KEY_CODE_DISABLE;
+                return 1;
+
+            case setting_type::SUBST:
+                if (data != nullptr)
+                    data[p] = *setting.try_get_subst_key();
+                return 1;
+
+            case setting_type::MACRO:
+                return try_encode_macro_entries(**setting.try_get_macro(), (data != nullptr) ? data + p : nullptr, data_size - p);
+        }
+        return lobera_result<size_t>(lobera_errc::UNKNOWN_SETTING_TYPE, static_cast<int32_t>(setting.get_type()));
+    }
+
+    size_t encode_key_setting(lobera_usb::key_setting const & setting, uint8_t * data, size_t data_size, size_t p)
+    {
+        return try_encode_key_setting(setting, data, data_size, p).value();
+    }
+
+    lobera_result<lobera_usb::keys_settings> try_decode_keys_settings(std::vector<offset_entry> const & offsets,
+                                                                      std::vector<repeat_entry> const & repeats,
+                                                                      uint8_t                   const * data,
+                                                                      size_t                            data_size) noexcept
+    {
+        lobera_usb::keys_settings ret;
+
+        auto ioff = offsets.begin(), eoff = offsets.end();
+        auto irep = repeats.begin(), erep = repeats.end();
+        for (; (ioff != eoff) && (irep != erep); ++ioff, ++irep)
+        {
+            auto setting = try_decode_key_setting(data, data_size, *ioff, irep->mode);
+            if (!setting)
+                return setting.error();
+            try
+            {
+                ret.emplace(irep->key, std::move(*setting));
+            }
+            catch (std::bad_alloc const &)
+            {
+                return lobera_errc::OUT_OF_MEMORY;
+            }
+        }
+
+        return ret;
+    }
+
+    lobera_usb::keys_settings decode_keys_settings(std::vector<offset_entry> const & offsets,
+                                                   std::vector<repeat_entry> const & repeats,
+                                                   uint8_t                   const * data,
+                                                   size_t                            data_size)
+    {
+        return try_decode_keys_settings(offsets, repeats, data, data_size).value();
+    }
+
+    size_t encode_keys_settings(lobera_usb::keys_settings const & settings, uint8_t * data, size_t data_size)
+    {
+        size_t p = 0;
+        for (auto const & setting: settings)
+            p += encode_key_setting(setting.second, data, data_size, p);
+        return p;
+    }
+
+    size_t check_keys_settings(lobera_usb::keys_settings const & settings)
+    {
+        if (settings.size() > MAX_KEYS)
+            throw std::runtime_error("Too many keys: " + std::to_string(settings.size()) + " (max " + std::to_string(MAX_KEYS) + ")");
+        for (auto const & setting: settings)
+        {
+            if ((setting.second.get_type() == lobera_usb::key_setting::type::SUBST) && (setting.second.get_subst_key() >= KEY_CODE_DISABLE))
+                throw std::runtime_error("Invalid substitution key code: " + std::to_string(setting.second.get_subst_key()));
+            if ((setting.second.get_type() == lobera_usb::key_setting::type::MACRO) && setting.second.get_macro().empty())
+                throw std::runtime_error("Empty macro for key: " + std::to_string(setting.first));
+        }
+        size_t data_size = encode_keys_settings(settings, nullptr, 0);
+        if (data_size > MAX_DATA_SIZE)
+            throw std::runtime_error("Keys data is too large: " + std::to_string(data_size) + " bytes (max " + std::to_string(MAX_DATA_SIZE) + ")");
+        return data_size;
+    }
+
+    size_t calc_num_batches(size_t data_size)
+    {
+        size_t ret = data_size / BATCH_SIZE + (((data_size % BATCH_SIZE) > 0) ? 1 : 0);
+        return (ret > 0) ? ret : 1;
+    }
+
+    //
+    // Offsets block
+    //
+    lobera_result<size_t> try_decode_offset_entry(uint8_t const * data, size_t data_size, size_t p, offset_entry & entry) noexcept
+    {
+        using of_type = offset_entry::type;
+
+        of_type op = static_cast<of_type>(data[p]);
+        switch (op)
+        {
+            case of_type::OF_NONE:
+                return 0;
+
+            case of_type::OF_SUBST:
+            case of_type::OF_MACRO:
+                if ((data_size - p) < 5)
+                    return lobera_errc::BROKEN_OFFSETS;
+                entry.op     = op;
+                entry.offset = data[p + 1] * 0x100 + data[p + 2];
+                entry.len    = data[p + 3] * 0x100 + data[p + 4];
+                return 5;
+        }
+        return lobera_result<size_t>(lobera_errc::UNKNOWN_OFFSET_CODE, data[p]);
+    }
+
+    size_t decode_offset_entry(uint8_t const * data, size_t data_size, size_t p, offset_entry & entry)
+    {
+        return try_decode_offset_entry(data, data_size, p, entry).value();
+    }
+
+    size_t encode_offset_entry(lobera_usb::keys_settings::value_type      const & entry,
+                               size_t                                            & offset,
+                               uint8_t                                           * data,
+                               size_t                                              data_size,
+                               size_t                                              p)
+    {
+        using setting_type = lobera_usb::key_setting::type;
+        size_t sz = encode_key_setting(entry.second, nullptr, 0, 0);
+        if (sz == 0)
+            return 0;
+
+        uint8_t entry_type;
+        switch (entry.second.get_type())
+        {
+            case setting_type::DISABLE:
+            case setting_type::SUBST:
+                entry_type = 0x10;
+                break;
+            case setting_type::MACRO:
+                entry_type = 0x20;
+                break;
+            default:
+                throw std::runtime_error(std::string("Unknown offset entry code: ") + std::to_string(static_cast<unsigned>(entry.second.get_type())));
+        };
+
+        size_t prev_offset = offset;
+        offset += sz;
+        if (data != nullptr)
+        {
+            if ((data_size - p) < 5)
+                return 0;
+            data[p++] = entry_type;
+            data[p++] = prev_offset >> 8;
+            data[p++] = prev_offset & 0xff;
+            data[p++] = sz >> 8;
+            data[p++] = sz & 0xff;
+        }
+        return 5;
+    }
+
+    lobera_result<void> try_decode_offset_entries(uint8_t const * data, size_t data_size, std::vector<offset_entry> & entries) noexcept
+    {
+        size_t end = (data_size > 5) ? 5 + lobera_simd::find_zero_record(data + 5, data_size - 5, 5) : data_size;
+
+        entries.clear();
+        try
+        {
+            entries.reserve((end - std::min<size_t>(end, 5)) / 5);
+        }
+        catch (std::bad_alloc const &)
+        {
+            return lobera_errc::OUT_OF_MEMORY;
+        }
+        for (size_t p = 5; p < end; )
+        {
+            offset_entry entry;
+            auto sz = try_decode_offset_entry(data, data_size, p, entry);
+            if (!sz)
+                return sz.error();
+            if (*sz == 0)
+                break;
+            p += *sz;
+            entries.push_back(entry);
+        }
+        return {};
+    }
+
+    lobera_result<std::vector<offset_entry>> try_decode_offset_entries(uint8_t const * data, size_t data_size) noexcept
+    {
+        std::vector<offset_entry> entries;
+        auto ret = try_decode_offset_entries(data, data_size, entries);
+        if (!ret)
+            return ret.error();
+        return entries;
+    }
+
+    std::vector<offset_entry> decode_offset_entries(uint8_t const * data, size_t data_size)
+    {
+        return try_decode_offset_entries(data, data_size).value();
+    }
+
+    void encode_offset_entries(lobera_usb::keys_settings const & entries, uint8_t * data, size_t data_size)
+    {
+        data[0] = 0x72;
+        data[1] = (data_size >> 8) & 0xff;
+        data[2] = data_size & 0xff;
+
+        size_t offset = 0, p = 5;
+        for (auto const & entry: entries)
+        {
+            size_t sz = encode_offset_entry(entry, offset, data, data_size, p);
+            if (sz == 0)
+                break;
+            p += sz;
+        }
+
+        data[3] = (offset >> 8) & 0xff;
+        data[4] = offset & 0xff;
+    }
+
+    lobera_result<void> try_encode_offset_table(std::vector<offset_entry> const & entries,
+                                                size_t                            keys_data_size,
+                                                uint8_t                         * data,
+                                                size_t                            data_size) noexcept
+    {
+        if (entries.size() * 5 + 5 > data_size)
+            return lobera_errc::TOO_MANY_KEYS;
+
+        std::memset(data, 0, data_size);
+        data[0] = 0x72;
+        data[1] = (data_size >> 8) & 0xff;
+        data[2] = data_size & 0xff;
+        data[3] = (keys_data_size >> 8) & 0xff;
+        data[4] = keys_data_size & 0xff;
+
+        size_t p = 5;
+        for (auto const & entry: entries)
+        {
+            data[p++] = static_cast<uint8_t>(entry.op);
+            data[p++] = entry.offset >> 8;
+            data[p++] = entry.offset & 0xff;
+            data[p++] = entry.len >> 8;
+            data[p++] = entry.len & 0xff;
+        }
+        return {};
+    }
+
+    void encode_offset_table(std::vector<offset_entry> const & entries, size_t keys_data_size, uint8_t * data, size_t data_size)
+    {
+        try_encode_offset_table(entries, keys_data_size, data, data_size).value();
+    }
+
+    //
+    // Streaming keys data
+    //
+    lobera_result<void> keys_stream_decoder::reset(std::vector<offset_entry> const & offsets,
+                                                   std::vector<repeat_entry> const & repeats,
+                                                   size_t                            data_size) noexcept
+    {
+        entries_.clear();
+        first_ = next_ = fed_ = 0;
+        if (offsets.size() != repeats.size())
+            return lobera_errc::INVALID_IMAGE;
+
+        try
+        {
+            entries_.reserve(offsets.size());
+            for (size_t i = 0; i < offsets.size(); ++i)
+            {
+                offset_entry const & offset = offsets[i];
+                if ((offset.op != offset_entry::type::OF_SUBST) && (offset.op != offset_entry::type::OF_MACRO))
+                    return lobera_result<void>(lobera_errc::UNKNOWN_RECORD_TYPE, static_cast<int32_t>(offset.op));
+
+                // Substitutions are one byte whatever their length says
+                size_t end = offset.offset + ((offset.op == offset_entry::type::OF_SUBST) ? 1 : offset.len);
+                if (end > data_size)
+                    return lobera_errc::BROKEN_OFFSETS;
+
+                pending e;
+                e.key  = repeats[i].key;
+                e.mode = repeats[i].mode;
+                e.op   = offset.op;
+                e.pos  = offset.offset;
+                e.end  = end;
+                entries_.push_back(std::move(e));
+            }
+        }
+        catch (std::bad_alloc const &)
+        {
+            return lobera_errc::OUT_OF_MEMORY;
+        }
+        // Images written by the library are already in data order
+        auto by_pos = [](pending const & a, pending const & b) { return a.pos < b.pos; };
+        if (!std::is_sorted(entries_.begin(), entries_.end(), by_pos))
+            std::stable_sort(entries_.begin(), entries_.end(), by_pos);
+        return {};
+    }
+
+    lobera_result<void> keys_stream_decoder::feed(size_t pos, uint8_t const * data, size_t size, key_callback const & cb)
+    {
+        if (pos < fed_)
+            return lobera_errc::INVALID_IMAGE;
+        size_t lim = pos + size;
+
+        // Skipped bytes must not be needed by anyone
+        if (next_needed() < pos)
+            return lobera_errc::INVALID_IMAGE;
+        while ((next_ < entries_.size()) && (entries_[next_].pos < lim))
+            ++next_;
+
+        for (size_t i = first_; i < next_; ++i)
+        {
+            if (entries_[i].finished)
+                continue;
+            auto ret = consume(entries_[i], pos, data, lim, cb);
+            if (!ret)
+                return ret;
+        }
+        while ((first_ < next_) && entries_[first_].finished)
+            ++first_;
+
+        fed_ = lim;
+        return {};
+    }
+
+    size_t keys_stream_decoder::next_needed() const
+    {
+        size_t ret = (next_ < entries_.size()) ? entries_[next_].pos : SIZE_MAX;
+        for (size_t i = first_; i < next_; ++i)
+        {
+            if (!entries_[i].finished)
+                ret = std::min(ret, entries_[i].pos);
+        }
+        return ret;
+    }
+
+    lobera_result<void> keys_stream_decoder::consume(pending & e, size_t pos, uint8_t const * data, size_t lim, key_callback const & cb)
+    {
+        lim = std::min(lim, e.end);
+
+        if (e.op == offset_entry::type::OF_SUBST)
+        {
+            uint8_t key = data[e.pos - pos];
+            e.pos = e.end;
+            e.finished = true;
+            if (key >= KEY_CODE_DISABLE)
+                cb(e.key, lobera_usb::key_setting(e.mode));
+            else
+                cb(e.key, lobera_usb::key_setting(key, e.mode));
+            return {};
+        }
+
+        // Upper bound, the macro may end early on a 0x00 record
+        if (e.macro.empty())
+            e.macro.reserve((e.end - e.pos) / 3);
+
+        bool terminated = false;
+        while ((e.pos < lim) && !terminated)
+        {
+            uint8_t const * p = data + (e.pos - pos);
+            lobera_usb::macro_entry entry;
+
+            // Whole records straight from the chunk
+            if ((e.record_size == 0) && (lim - e.pos >= 3))
+            {
+                if (*p == 0x00)
+                {
+                    terminated = true;
+                    break;
+                }
+                auto sz = try_decode_macro_entry(p, 3, 0, entry);
+                if (!sz)
+                    return sz.error();
+                e.macro.push_back(entry);
+                e.pos += 3;
+                continue;
+            }
+
+            // Record split by the chunk end or cut by the key end
+            if ((e.record_size == 0) && (*p == 0x00))
+            {
+                terminated = true;
+                break;
+            }
+            e.record[e.record_size++] = *p;
+            ++e.pos;
+            if ((e.record_size == 1) && (*p != 0x84) && (*p != 0x86) && (*p != 0x87))
+                return lobera_result<void>(lobera_errc::UNKNOWN_MACRO_CODE, *p);
+            if (e.record_size == 3)
+            {
+                try_decode_macro_entry(e.record, 3, 0, entry);
+                e.macro.push_back(entry);
+                e.record_size = 0;
+            }
+        }
+
+        if (!terminated && (e.pos < e.end))
+            return {};
+        if (!terminated && (e.record_size != 0))
+            return lobera_errc::BROKEN_MACRO;
+
+        e.pos = e.end;
+        e.finished = true;
+        cb(e.key, lobera_usb::key_setting(std::move(e.macro), e.mode));
+        return {};
+    }
+
+    keys_stream_encoder::keys_stream_encoder(lobera_usb::keys_settings const & settings)
+        : settings_(settings)
+        , key_(settings.begin())
+        , data_size_(check_keys_settings(settings))
+    {   }
+
+    bool keys_stream_encoder::next_batch(uint8_t * batch)
+    {
+        if (batches_ == num_batches())
+            return false;
+        ++batches_;
+
+        size_t p = 0;
+        size_t carry = std::min(record_size_ - record_pos_, static_cast<size_t>(BATCH_SIZE));
+        std::memcpy(batch, record_ + record_pos_, carry);
+        p += carry;
+        record_pos_ = record_size_ = 0;
+
+        for (; (key_ != settings_.end()) && (p < BATCH_SIZE); )
+        {
+            lobera_usb::key_setting const & setting = key_->second;
+            if (setting.get_type() != lobera_usb::key_setting::type::MACRO)
+            {
+                p += encode_key_setting(setting, batch, BATCH_SIZE, p);
+                ++key_;
+                continue;
+            }
+
+            // Records are 3 bytes: the ones that fit whole, then at most one
+            // split record whose head ends this batch and tail starts the next
+            lobera_usb::macro const & macro = setting.get_macro();
+            size_t whole = entry_ + std::min(macro.size() - entry_, (BATCH_SIZE - p) / 3);
+            for (; entry_ < whole; ++entry_)
+                p += encode_macro_entry(macro[entry_], batch, BATCH_SIZE, p);
+            if ((entry_ < macro.size()) && (p < BATCH_SIZE))
+            {
+                record_size_ = encode_macro_entry(macro[entry_++], record_, sizeof(record_), 0);
+                record_pos_  = BATCH_SIZE - p;
+                std::memcpy(batch + p, record_, record_pos_);
+                p = BATCH_SIZE;
+            }
+            if (entry_ == macro.size())
+            {
+                entry_ = 0;
+                ++key_;
+            }
+        }
+
+        std::memset(batch + p, 0, BATCH_SIZE - p);
+        return true;
+    }
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+//
+// Wire format of the profile blocks. Used by lobera_usb and by the
+// libusb-free image compiler.
+//
+// The try_* functions report malformed input through lobera_result instead
+// of throwing; the plain functions call them and throw on error.
+//
+namespace lobera_codec
+{
+    struct offset_entry
+    {
+        enum struct type: uint8_t
+        {
+            OF_NONE  = 0x00,
+            OF_SUBST = 0x10,
+            OF_MACRO = 0x20,
+        };
+
+        type     op = type::OF_NONE;
+        uint16_t offset;
+        uint16_t len;
+    };
+
+    struct repeat_entry
+    {
+        uint8_t                 key;
+        lobera_usb::repeat_mode mode;
+    };
+
+    //
+    // Repeats block
+    //
+    lobera_result<size_t> try_decode_repeat_entry(uint8_t const * data, size_t data_size, size_t p, repeat_entry & entry) noexcept;
+    size_t decode_repeat_entry(uint8_t const * data, size_t data_size, size_t p, repeat_entry & entry);
+    size_t encode_repeat_entry(lobera_usb::keys_settings::value_type      const & entry,
+                               uint8_t                                           * data,
+                               size_t                                              data_size,
+                               size_t                                              p);
+    lobera_result<void> try_decode_repeat_entries(uint8_t const * data, size_t data_size, std::vector<repeat_entry> & entries) noexcept;
+    lobera_result<std::vector<repeat_entry>> try_decode_repeat_entries(uint8_t const * data, size_t data_size) noexcept;
+    std::vector<repeat_entry> decode_repeat_entries(uint8_t const * data, size_t data_size);
+    void encode_repeat_entries(lobera_usb::keys_settings const & entries, uint8_t * data, size_t data_size);
+    lobera_result<void> try_encode_repeat_table(std::vector<repeat_entry> const & entries, uint8_t * data, size_t data_size) noexcept;
+    void encode_repeat_table(std::vector<repeat_entry> const & entries, uint8_t * data, size_t data_size);
+
+    //
+    // Macro
+    //
+    lobera_result<size_t> try_decode_macro_entry(uint8_t const * data, size_t data_size, size_t p, lobera_usb::macro_entry & entry) noexcept;
+    size_t decode_macro_entry(uint8_t const * data, size_t data_size, size_t p, lobera_usb::macro_entry & entry);
+    lobera_result<size_t> try_encode_macro_entry(lobera_usb::macro_entry const & entry, uint8_t * data, size_t data_size, size_t p) noexcept;
+    size_t encode_macro_entry(lobera_usb::macro_entry const & entry, uint8_t * data, size_t data_size, size_t p);
+    lobera_result<lobera_usb::macro> try_decode_macro_entries(uint8_t const * data, size_t data_size) noexcept;
+    lobera_usb::macro decode_macro_entries(uint8_t const * data, size_t data_size);
+    lobera_result<size_t> try_encode_macro_entries(lobera_usb::macro const & entries, uint8_t * data, size_t data_size) noexcept;
+    size_t encode_macro_entries(lobera_usb::macro const & entries, uint8_t * data, size_t data_size);
+
+    //
+    // Keys
+    //
+    lobera_result<lobera_usb::key_setting> try_decode_key_setting(uint8_t                 const * data,
+                                                                  size_t                          data_size,
+                                                                  offset_entry            const & offset,
+                                                                  lobera_usb::repeat_mode         repeat) noexcept;
+    lobera_usb::key_setting decode_key_setting(uint8_t                 const * data,
+                                               size_t                          data_size,
+                                               offset_entry            const & offset,
+                                               lobera_usb::repeat_mode         repeat);
+    lobera_result<size_t> try_encode_key_setting(lobera_usb::key_setting const & setting, uint8_t * data, size_t data_size, size_t p) noexcept;
+    size_t encode_key_setting(lobera_usb::key_setting const & setting, uint8_t * data, size_t data_size, size_t p);
+    lobera_result<lobera_usb::keys_settings> try_decode_keys_settings(std::vector<offset_entry> const & offsets,
+                                                                      std::vector<repeat_entry> const & repeats,
+                                                                      uint8_t                   const * data,
+                                                                      size_t                            data_size) noexcept;
+    lobera_usb::keys_settings decode_keys_settings(std::vector<offset_entry> const & offsets,
+                                                   std::vector<repeat_entry> const & repeats,
+                                                   uint8_t                   const * data,
+                                                   size_t                            data_size);
+    size_t encode_keys_settings(lobera_usb::keys_settings const & settings, uint8_t * data, size_t data_size);
+
+    // Capacity checks the encoders don't do (they silently drop what doesn't
+    // fit), returns the keys data size
+    size_t check_keys_settings(lobera_usb::keys_settings const & settings);
+
+    size_t calc_num_batches(size_t data_size);
+
+    //
+    // Offsets block
+    //
+    lobera_result<size_t> try_decode_offset_entry(uint8_t const * data, size_t data_size, size_t p, offset_entry & entry) noexcept;
+    size_t decode_offset_entry(uint8_t const * data, size_t data_size, size_t p, offset_entry & entry);
+    size_t encode_offset_entry(lobera_usb::keys_settings::value_type      const & entry,
+                               size_t                                            & offset,
+                               uint8_t                                           * data,
+                               size_t                                              data_size,
+                               size_t                                              p);
+    lobera_result<void> try_decode_offset_entries(uint8_t const * data, size_t data_size, std::vector<offset_entry> & entries) noexcept;
+    lobera_result<std::vector<offset_entry>> try_decode_offset_entries(uint8_t const * data, size_t data_size) noexcept;
+    std::vector<offset_entry> decode_offset_entries(uint8_t const * data, size_t data_size);
+    void encode_offset_entries(lobera_usb::keys_settings const & entries, uint8_t * data, size_t data_size);
+    lobera_result<void> try_encode_offset_table(std::vector<offset_entry> const & entries,
+                                                size_t                            keys_data_size,
+                                                uint8_t                         * data,
+                                                size_t                            data_size) noexcept;
+    void encode_offset_table(std::vector<offset_entry> const & entries, size_t keys_data_size, uint8_t * data, size_t data_size);
+
+    //
+    // Streaming keys data
+    //
+    typedef lobera_usb::key_callback key_callback;
+
+    // Decodes keys as data batches arrive. A key is delivered as soon as its
+    // last byte is fed, so keys come in data order. Records straddling two
+    // batches are carried over, only keys in progress are buffered.
+    class keys_stream_decoder
+    {
+    public:
+        // Tables of the profile, data_size is the size of all its batches
+        lobera_result<void> reset(std::vector<offset_entry> const & offsets,
+                                  std::vector<repeat_entry> const & repeats,
+                                  size_t                            data_size) noexcept;
+
+        // Data at pos, chunks must come in order. Bytes no key needs may be
+        // skipped, next_needed() tells where the next needed byte is.
+        lobera_result<void> feed(size_t pos, uint8_t const * data, size_t size, key_callback const & cb);
+
+        // SIZE_MAX once all keys are delivered
+        size_t next_needed() const;
+
+        bool done() const
+        {   return next_needed() == SIZE_MAX;   }
+
+    private:
+        struct pending
+        {
+            uint8_t                 key;
+            lobera_usb::repeat_mode mode;
+            offset_entry::type      op;
+            size_t                  pos;            // next byte to consume
+            size_t                  end;
+            bool                    finished = false;
+            uint8_t                 record[3] = {}; // macro record split by a chunk end
+            size_t                  record_size = 0;
+            lobera_usb::macro       macro;
+        };
+
+        lobera_result<void> consume(pending & e, size_t pos, uint8_t const * data, size_t lim, key_callback const & cb);
+
+    private:
+        std::vector<pending> entries_;  // by start offset
+        size_t               first_ = 0; // first unfinished entry
+        size_t               next_  = 0; // first entry not started
+        size_t               fed_   = 0;
+    };
+
+    // Encodes keys data a batch at a time, in the layout of
+    // encode_keys_settings(); settings are checked on construction and must
+    // outlive the encoder
+    class keys_stream_encoder
+    {
+    public:
+        explicit keys_stream_encoder(lobera_usb::keys_settings const & settings);
+
+        size_t data_size() const
+        {   return data_size_;   }
+
+        size_t num_batches() const
+        {   return calc_num_batches(data_size_);   }
+
+        // Fills BATCH_SIZE bytes, zero padded past the data; false once all
+        // batches are encoded
+        bool next_batch(uint8_t * batch);
+
+    private:
+        lobera_usb::keys_settings const &         settings_;
+        lobera_usb::keys_settings::const_iterator key_;
+        size_t                                    entry_       = 0; // next macro entry of key_
+        uint8_t                                   record_[3];       // record split by a batch end
+        size_t                                    record_pos_  = 0;
+        size_t                                    record_size_ = 0;
+        size_t                                    data_size_;
+        size_t                                    batches_     = 0;
+    };
+}
@@ -0,0 +1,128 @@
+#include "lobera_color_stream.hpp"
+
+lobera_color_stream::lobera_color_stream(lobera_usb & device)
+    : device_(device)
+    , newest_(device.get_profile_colors())
+{
+    thread_ = std::thread(&lobera_color_stream::run, this);
+}
+
+lobera_color_stream::~lobera_color_stream()
+{
+    stop();
+}
+
+void lobera_color_stream::push(frame const & f)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    push_locked(f);
+}
+
+void lobera_color_stream::set_color(uint8_t profile, uint32_t rgb)
+{
+    if (profile > 5)
+        throw std::runtime_error("Invalid profile number");
+
+    // Read and publish under one lock, concurrent changes to other colors
+    // are kept
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame f = newest_;
+    f[profile] = rgb;
+    push_locked(f);
+}
+
+void lobera_color_stream::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    written_cv_.wait(lock, [this] { return (!has_pending_ && !busy_) || error_ || stop_; });
+    check_error();
+}
+
+void lobera_color_stream::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        pending_cv_.notify_one();
+    }
+    if (thread_.joinable())
+        thread_.join();
+}
+
+size_t lobera_color_stream::frames_written() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return written_;
+}
+
+size_t lobera_color_stream::frames_dropped() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+}
+
+void lobera_color_stream::run()
+{
+    frame last;
+    bool has_last = false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+        // The newest frame is still written after stop(), it's the color
+        // the caller asked for last
+        pending_cv_.wait(lock, [this] { return has_pending_ || stop_; });
+        if (!has_pending_)
+            break;
+
+        frame f = pending_;
+        has_pending_ = false;
+        busy_        = true;
+        lock.unlock();
+
+        try
+        {
+            // Pacing happens inside write, new frames replace pending one meanwhile
+            bool changed = !has_last || (f != last);
+            if (changed)
+                device_.set_profile_colors(f);
+            last     = f;
+            has_last = true;
+            lock.lock();
+            if (changed)
+                ++written_;
+        }
+        catch (...)
+        {
+            lock.lock();
+            error_ = std::current_exception();
+        }
+
+        busy_ = false;
+        written_cv_.notify_all();
+        if (error_)
+            break;
+    }
+    written_cv_.notify_all();
+}
+
+void lobera_color_stream::push_locked(frame const & f)
+{
+    check_error();
+    if (stop_)
+        throw std::runtime_error("Color stream is stopped");
+
+    if (has_pending_)
+        ++dropped_;
+    pending_     = f;
+    newest_      = f;
+    has_pending_ = true;
+    pending_cv_.notify_one();
+}
+
+void lobera_color_stream::check_error()
+{
+    // The worker is gone after an error, so it's reported on every call
+    if (error_)
+        std::rethrow_exception(error_);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+//
+// Streams color frames to the device from a background thread.
+//
+// Frames can be pushed at any rate and never block on USB: only the newest
+// pending frame is kept, older ones are dropped. Each frame is a single
+// W_COLORS transfer of all six colors, paced by the device cool-down, so
+// the latency of the newest frame is bounded by one frame being written.
+//
+// The device must not be used by other threads while the stream runs.
+//
+class lobera_color_stream
+{
+public:
+    typedef std::array<uint32_t, 6> frame;
+
+public:
+    explicit lobera_color_stream(lobera_usb & device);
+    ~lobera_color_stream();
+
+    void push(frame const & f);
+
+    // Changes one color of the newest frame
+    void set_color(uint8_t profile, uint32_t rgb);
+
+    // Waits until the newest frame is written
+    void flush();
+
+    // Writes the pending frame, if any, and ends the worker. The
+    // destructor stops the stream.
+    void stop();
+
+    // Frames equal to the last written one are skipped, not counted
+    size_t frames_written() const;
+    size_t frames_dropped() const;
+
+private:
+    void run();
+    void push_locked(frame const & f);
+    void check_error();
+
+private:
+    lobera_usb              & device_;
+
+    mutable std::mutex        mutex_;
+    std::condition_variable   pending_cv_;
+    std::condition_variable   written_cv_;
+    frame                     pending_;
+    frame                     newest_;
+    bool                      has_pending_ = false;
+    bool                      busy_        = false;
+    bool                      stop_        = false;
+    std::exception_ptr        error_;
+    size_t                    written_     = 0;
+    size_t                    dropped_     = 0;
+
+    std::thread               thread_;
+};
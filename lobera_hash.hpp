@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// FNV-1a, for hashes that must be stable across hosts and builds
+struct fnv1a
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    void add(uint8_t b)
+    {
+        h ^= b;
+        h *= 0x100000001b3ull;
+    }
+
+    void add16(uint16_t v)
+    {
+        add(v >> 8);
+        add(v & 0xff);
+    }
+
+    void add(uint8_t const * data, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            add(data[i]);
+    }
+};
@@ -0,0 +1,271 @@
+#include "lobera_image.hpp"
+#include "lobera_codec.hpp"
+#include "lobera_hash.hpp"
+#include "lobera_protocol.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC      "LBIM"
+#define IMAGE_VERSION    1
+
+namespace
+{
+    bool check_image(lobera_usb::profile_image const & image)
+    {
+        if ((image.offsets.size() != OFFSETS_SIZE) || (image.repeats.size() != REPEAT_SIZE))
+            return false;
+        if (image.data.empty() || ((image.data.size() % BATCH_SIZE) != 0))
+            return false;
+        return true;
+    }
+
+    lobera_result<lobera_usb::keys_settings> decode_image(lobera_usb::profile_image         const & image,
+                                                          std::vector<lobera_codec::offset_entry> & offsets,
+                                                          std::vector<lobera_codec::repeat_entry> & repeats) noexcept
+    {
+        if (!check_image(image))
+            return lobera_errc::INVALID_IMAGE;
+
+        if ((image.offsets[0] != 0x72) && (image.offsets[0] != 0x00))
+            return lobera_errc::INVALID_IMAGE;
+        size_t table_size = image.offsets[1] * 0x100 + image.offsets[2];
+        if ((table_size != image.offsets.size()) && (table_size != 0))
+            return lobera_errc::INVALID_IMAGE;
+
+        auto ret = lobera_codec::try_decode_offset_entries(image.offsets.data(), image.offsets.size(), offsets);
+        if (!ret)
+            return ret.error();
+        for (auto const & offset: offsets)
+        {
+            if (static_cast<size_t>(offset.offset) + offset.len > image.data.size())
+                return lobera_errc::INVALID_IMAGE;
+        }
+
+        ret = lobera_codec::try_decode_repeat_entries(image.repeats.data(), image.repeats.size(), repeats);
+        if (!ret)
+            return ret.error();
+        if (repeats.size() != offsets.size())
+            return lobera_errc::INVALID_IMAGE;
+
+        return lobera_codec::try_decode_keys_settings(offsets, repeats, image.data.data(), image.data.size());
+    }
+}
+
+lobera_usb::profile_image lobera_usb::compile_profile_image(keys_settings const & settings)
+{
+    profile_image image;
+    compile_profile_image(settings, image);
+    return image;
+}
+
+void lobera_usb::compile_profile_image(keys_settings const & settings, profile_image & image)
+{
+    size_t data_size = lobera_codec::check_keys_settings(settings);
+    size_t num_batches = lobera_codec::calc_num_batches(data_size);
+    image.data.assign(num_batches * BATCH_SIZE, 0);
+    lobera_codec::encode_keys_settings(settings, image.data.data(), image.data.size());
+
+    image.offsets.assign(OFFSETS_SIZE, 0);
+    lobera_codec::encode_offset_entries(settings, image.offsets.data(), image.offsets.size());
+
+    image.repeats.assign(REPEAT_SIZE, 0);
+    lobera_codec::encode_repeat_entries(settings, image.repeats.data(), image.repeats.size());
+}
+
+lobera_result<lobera_usb::keys_settings> lobera_usb::try_decode_profile_image(profile_image const & image) noexcept
+{
+    std::vector<lobera_codec::offset_entry> offsets;
+    std::vector<lobera_codec::repeat_entry> repeats;
+    return decode_image(image, offsets, repeats);
+}
+
+lobera_usb::keys_settings lobera_usb::decode_profile_image(profile_image const & image)
+{
+    return try_decode_profile_image(image).value();
+}
+
+uint64_t hash_keys_settings(lobera_usb::keys_settings const & settings)
+{
+    using setting_type = lobera_usb::key_setting::type;
+    using macro_type   = lobera_usb::macro_entry::type;
+
+    fnv1a h;
+    h.add(IMAGE_VERSION);
+    for (auto const & setting: settings)
+    {
+        h.add(setting.first);
+        h.add(static_cast<uint8_t>(setting.second.get_type()));
+        h.add(static_cast<uint8_t>(setting.second.get_repeat_mode()));
+        switch (setting.second.get_type())
+        {
+            case setting_type::DISABLE:
+                break;
+
+            case setting_type::SUBST:
+                h.add(setting.second.get_subst_key());
+                break;
+
+            case setting_type::MACRO:
+                h.add16(setting.second.get_macro().size());
+                for (auto const & entry: setting.second.get_macro())
+                {
+                    h.add(static_cast<uint8_t>(entry.get_type()));
+                    switch (entry.get_type())
+                    {
+                        case macro_type::KEY_DN:
+                        case macro_type::KEY_UP:
+                            h.add(entry.get_key_code());
+                            break;
+                        case macro_type::REPEAT:
+                            h.add16(entry.get_repeat());
+                            break;
+                        case macro_type::SLEEP:
+                            h.add16(entry.get_delay());
+                            break;
+                        case macro_type::NONE:
+                            break;
+                    }
+                }
+                break;
+        }
+    }
+    return h.h;
+}
+
+//
+// Image file: magic, version, number of batches, offsets, repeats, data
+//
+void save_profile_image(std::ostream & os, lobera_usb::profile_image const & image)
+{
+    if (!check_image(image))
+        throw std::runtime_error("Invalid profile image");
+
+    size_t num_batches = image.data.size() / BATCH_SIZE;
+    uint8_t header[7] = {
+        IMAGE_MAGIC[0], IMAGE_MAGIC[1], IMAGE_MAGIC[2], IMAGE_MAGIC[3],
+        IMAGE_VERSION,
+        static_cast<uint8_t>(num_batches >> 8), static_cast<uint8_t>(num_batches & 0xff)
+    };
+    os.write(reinterpret_cast<char const *>(header), sizeof(header));
+    os.write(reinterpret_cast<char const *>(image.offsets.data()), image.offsets.size());
+    os.write(reinterpret_cast<char const *>(image.repeats.data()), image.repeats.size());
+    os.write(reinterpret_cast<char const *>(image.data.data()), image.data.size());
+    if (!os)
+        throw std::runtime_error("Error writing profile image");
+}
+
+lobera_usb::profile_image load_profile_image(std::istream & is)
+{
+    uint8_t header[7] = {0};
+    is.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (!is || (std::memcmp(header, IMAGE_MAGIC, 4) != 0) || (header[4] != IMAGE_VERSION))
+        throw std::runtime_error("Invalid profile image file");
+
+    // Checked before allocating, the header of a corrupt file can claim
+    // up to 256 MB
+    size_t num_batches = header[5] * 0x100 + header[6];
+    if ((num_batches == 0) || (num_batches > lobera_codec::calc_num_batches(MAX_DATA_SIZE)))
+        throw std::runtime_error("Invalid profile image file");
+
+    lobera_usb::profile_image image;
+    image.offsets.resize(OFFSETS_SIZE);
+    image.repeats.resize(REPEAT_SIZE);
+    image.data.resize(num_batches * BATCH_SIZE);
+    is.read(reinterpret_cast<char *>(image.offsets.data()), image.offsets.size());
+    is.read(reinterpret_cast<char *>(image.repeats.data()), image.repeats.size());
+    is.read(reinterpret_cast<char *>(image.data.data()), image.data.size());
+    if (!is)
+        throw std::runtime_error("Truncated profile image file");
+    return image;
+}
+
+//
+// Image cache
+//
+lobera_image_cache::lobera_image_cache(std::string const & dir)
+    : dir_(dir)
+{
+    if ((::mkdir(dir_.c_str(), 0755) != 0) && (errno != EEXIST))
+        throw std::runtime_error("Error creating image cache directory: " + dir_);
+}
+
+lobera_usb::profile_image lobera_image_cache::compile(lobera_usb::keys_settings const & settings)
+{
+    uint64_t hash = hash_keys_settings(settings);
+
+    // The hash alone doesn't prove the entry is ours, a colliding layout is
+    // treated as a miss and replaced
+    lobera_usb::profile_image image;
+    if (load(hash, image))
+    {
+        auto cached = lobera_usb::try_decode_profile_image(image);
+        if (cached && (*cached == settings))
+            return image;
+    }
+
+    image = lobera_usb::compile_profile_image(settings);
+    store(hash, image);
+    return image;
+}
+
+bool lobera_image_cache::load(uint64_t hash, lobera_usb::profile_image & image) const
+{
+    std::ifstream is(path(hash), std::ios::binary);
+    if (!is)
+        return false;
+
+    // Truncated or corrupt files are misses, the next store replaces them
+    try
+    {
+        image = load_profile_image(is);
+    }
+    catch (std::exception const &)
+    {
+        return false;
+    }
+    return true;
+}
+
+void lobera_image_cache::store(uint64_t hash, lobera_usb::profile_image const & image) const
+{
+    // Write aside and rename, so concurrent readers never see a partial file.
+    // The temporary name is unique per call, threads storing the same hash
+    // each rename a complete file.
+    static std::atomic<uint64_t> tmp_counter{0};
+    std::string target = path(hash);
+    std::string tmp    = target + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(tmp_counter.fetch_add(1));
+    try
+    {
+        std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+        if (!os)
+            throw std::runtime_error("Error writing image cache: " + tmp);
+        save_profile_image(os, image);
+        os.close();
+        if (!os)
+            throw std::runtime_error("Error writing image cache: " + tmp);
+    }
+    catch (...)
+    {
+        std::remove(tmp.c_str());
+        throw;
+    }
+    if (std::rename(tmp.c_str(), target.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("Error writing image cache: " + target);
+    }
+}
+
+std::string lobera_image_cache::path(uint64_t hash) const
+{
+    char name[32] = {0};
+    std::snprintf(name, sizeof(name), "%016llx.lbi", static_cast<unsigned long long>(hash));
+    return dir_ + "/" + name;
+}
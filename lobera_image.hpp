@@ -0,0 +1,38 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+#include <istream>
+#include <ostream>
+
+//
+// Profile wire images, built without the device.
+//
+// An image is compiled once from keys_settings and can be pushed with
+// lobera_usb::write_profile_image() any number of times.
+//
+
+// Stable hash of the settings, doesn't depend on the host or the build
+uint64_t hash_keys_settings(lobera_usb::keys_settings const & settings);
+
+void save_profile_image(std::ostream & os, lobera_usb::profile_image const & image);
+lobera_usb::profile_image load_profile_image(std::istream & is);
+
+// Content-addressed on-disk cache of compiled images, keyed by the hash of
+// the input settings. Safe to share between processes.
+class lobera_image_cache
+{
+public:
+    explicit lobera_image_cache(std::string const & dir);
+
+    // Returns cached image or compiles and stores a new one
+    lobera_usb::profile_image compile(lobera_usb::keys_settings const & settings);
+
+    bool load(uint64_t hash, lobera_usb::profile_image & image) const;
+    void store(uint64_t hash, lobera_usb::profile_image const & image) const;
+
+    std::string path(uint64_t hash) const;
+
+private:
+    std::string dir_;
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+//
+// In-memory mirror of device state for any number of reader threads.
+//
+// A lobera_usb with the mirror attached publishes what it writes, and what
+// it reads, as immutable snapshots swapped in atomically. Readers take the
+// current snapshot without issuing transfers, so they never wait on USB
+// pacing and always see one consistent state. Each publish bumps the
+// generation; key maps are shared between snapshots until they change.
+//
+// Reads are lock-free: the snapshot pointer is an atomic raw pointer, and
+// readers only announce themselves in one of two epoch counters while they
+// copy it. A writer flips the epoch after swapping the pointer and frees
+// the replaced one once the old epoch's readers are gone, so writers wait
+// for reads in flight, readers never wait for anyone.
+//
+// Fields not read or written yet are unknown. Bulk key writes that fail
+// part way leave the profile's keys unknown, they may be half written.
+//
+class lobera_mirror
+{
+public:
+    struct snapshot
+    {
+        enum : uint32_t
+        {
+            PROFILE    = 0x01,
+            LIGHT_MODE = 0x02,
+            BRIGHTNESS = 0x04,
+            FULL_NKPO  = 0x08,
+            COLORS     = 0x10,
+        };
+
+        uint64_t                                                         generation = 0;
+        uint32_t                                                         known      = 0;
+        uint8_t                                                          profile    = 0;
+        lobera_usb::status                                               status     = {false, 0, lobera_usb::light_mode::OFF};
+        std::array<uint32_t, 6>                                          colors     = {};
+        std::array<std::shared_ptr<lobera_usb::keys_settings const>, 5> keys;       // by profile - 1, null if unknown
+    };
+
+    // Per-thread view: refreshes only when the generation moved, so
+    // repeated reads of an unchanged state are a single atomic load
+    class reader
+    {
+    public:
+        explicit reader(lobera_mirror const & mirror)
+            : mirror_(mirror)
+            , current_(mirror.current())
+        {   }
+
+        snapshot const & get()
+        {
+            if (mirror_.generation_.load(std::memory_order_acquire) != current_->generation)
+                current_ = mirror_.current();
+            return *current_;
+        }
+
+    private:
+        lobera_mirror const             & mirror_;
+        std::shared_ptr<snapshot const>   current_;
+    };
+
+public:
+    lobera_mirror()
+        : current_(new snapshot_ptr(std::make_shared<snapshot const>()))
+    {   }
+
+    ~lobera_mirror()
+    {   delete current_.load();   }
+
+    lobera_mirror(lobera_mirror const &) = delete;
+    lobera_mirror & operator=(lobera_mirror const &) = delete;
+
+    std::shared_ptr<snapshot const> current() const
+    {
+        for (;;)
+        {
+            uint64_t epoch = epoch_.load();
+            readers_[epoch & 1].fetch_add(1);
+            // A reader that lost the race with a flip retries in the new
+            // epoch, the writer isn't waiting for the old one on its behalf
+            if (epoch_.load() == epoch)
+            {
+                snapshot_ptr ret = *current_.load();
+                readers_[epoch & 1].fetch_sub(1);
+                return ret;
+            }
+            readers_[epoch & 1].fetch_sub(1);
+        }
+    }
+
+    uint64_t generation() const
+    {   return generation_.load(std::memory_order_acquire);   }
+
+    // Publishes a copy of the current snapshot changed by f. Writers are
+    // serialized, readers keep the snapshot they hold. f may return false
+    // when it changed nothing, the copy is dropped then.
+    template<class F>
+    void update(F && f)
+    {
+        std::lock_guard<std::mutex> lock(update_mutex_);
+        auto next = std::make_shared<snapshot>(**current_.load());
+        if constexpr (std::is_same<decltype(f(*next)), bool>::value)
+        {
+            if (!f(*next))
+                return;
+        }
+        else
+            f(*next);
+        ++next->generation;
+        uint64_t generation = next->generation;
+
+        auto old = current_.exchange(new snapshot_ptr(std::move(next)));
+        generation_.store(generation, std::memory_order_release);
+
+        // Readers of the old epoch may still be copying old
+        uint64_t epoch = epoch_.fetch_add(1);
+        while (readers_[epoch & 1].load() != 0)
+            std::this_thread::yield();
+        delete old;
+    }
+
+    // Forgets everything, e.g. when the keyboard may have been changed by
+    // another program
+    void invalidate()
+    {
+        update([](snapshot & s) {
+            s.known = 0;
+            for (auto & k: s.keys)
+                k.reset();
+        });
+    }
+
+private:
+    typedef std::shared_ptr<snapshot const> snapshot_ptr;
+
+    std::mutex                            update_mutex_;
+    std::atomic<snapshot_ptr const *>     current_;
+    mutable std::atomic<uint64_t>         readers_[2] = {{0}, {0}};  // reads in flight by epoch parity
+    std::atomic<uint64_t>                 epoch_{0};
+    std::atomic<uint64_t>                 generation_{0};
+};
@@ -0,0 +1,90 @@
+#include "lobera_pacing_ledger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define LEDGER_MAGIC        0x4c42504c // "LBPL"
+#define LEDGER_VERSION      1
+#define LEDGER_MAX_AHEAD_MS 60000      // well over the longest cool-down
+
+struct lobera_pacing_ledger::record
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t next_read;
+    uint64_t next_write;
+};
+
+lobera_pacing_ledger::lobera_pacing_ledger(std::string const & device, std::string const & dir)
+{
+    std::string name = device;
+    std::replace(name.begin(), name.end(), '/', '-');
+    path_ = dir + "/lobera-pacing-" + name;
+
+    fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd_ < 0)
+        throw std::runtime_error("Error opening pacing ledger: " + path_ + " (" + std::strerror(errno) + ")");
+
+    // Every process sizes it the same, so racing creators are harmless
+    void * p = MAP_FAILED;
+    if (::ftruncate(fd_, sizeof(record)) == 0)
+        p = ::mmap(nullptr, sizeof(record), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED)
+    {
+        int err = errno;
+        ::close(fd_);
+        throw std::runtime_error("Error mapping pacing ledger: " + path_ + " (" + std::strerror(err) + ")");
+    }
+    record_ = static_cast<record *>(p);
+}
+
+lobera_pacing_ledger::~lobera_pacing_ledger()
+{
+    // Closing the file drops a lock still held
+    ::munmap(record_, sizeof(record));
+    ::close(fd_);
+}
+
+void lobera_pacing_ledger::acquire(uint64_t now, uint64_t & next_read, uint64_t & next_write) noexcept
+{
+    if (depth_++ > 0)
+        return;
+
+    // Without the lock transfers still go, paced by this process only
+    int ret;
+    while (((ret = ::flock(fd_, LOCK_EX)) != 0) && (errno == EINTR))
+    {   }
+    if (ret != 0)
+        return;
+    locked_ = true;
+
+    if ((record_->magic != LEDGER_MAGIC) || (record_->version != LEDGER_VERSION))
+    {
+        record_->magic      = LEDGER_MAGIC;
+        record_->version    = LEDGER_VERSION;
+        record_->next_read  = 0;
+        record_->next_write = 0;
+    }
+    if (record_->next_read <= now + LEDGER_MAX_AHEAD_MS)
+        next_read = std::max(next_read, record_->next_read);
+    if (record_->next_write <= now + LEDGER_MAX_AHEAD_MS)
+        next_write = std::max(next_write, record_->next_write);
+}
+
+void lobera_pacing_ledger::release(uint64_t next_read, uint64_t next_write) noexcept
+{
+    if ((depth_ == 0) || (--depth_ > 0) || !locked_)
+        return;
+
+    locked_ = false;
+    record_->next_read  = next_read;
+    record_->next_write = next_write;
+    ::flock(fd_, LOCK_UN);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+//
+// Pacing deadlines of one keyboard shared between processes.
+//
+// A small file per device (in /dev/shm by default) holds the next read and
+// write deadlines on the steady clock, mapped by every process using the
+// device. Holding the ledger takes an advisory lock on the file and merges
+// its deadlines into the caller's, releasing it publishes the caller's
+// deadlines back. A process starting right after another one's write
+// waits out exactly the remaining cool-down; a process holding the ledger
+// for a whole bulk write keeps the others out until it's done.
+//
+// Holding is reentrant per ledger object, not thread safe. The lock is
+// dropped by the kernel if a holder dies.
+//
+class lobera_pacing_ledger
+{
+public:
+    // device is a list_devices() id
+    explicit lobera_pacing_ledger(std::string const & device, std::string const & dir = "/dev/shm");
+    ~lobera_pacing_ledger();
+
+    lobera_pacing_ledger(lobera_pacing_ledger const &) = delete;
+    lobera_pacing_ledger & operator=(lobera_pacing_ledger const &) = delete;
+
+    std::string const & path() const
+    {   return path_;   }
+
+    // now is on the same clock as the deadlines. Shared deadlines further
+    // ahead than any cool-down are left over from before a reboot and are
+    // ignored.
+    void acquire(uint64_t now, uint64_t & next_read, uint64_t & next_write) noexcept;
+    void release(uint64_t next_read, uint64_t next_write) noexcept;
+
+private:
+    struct record;
+
+    std::string   path_;
+    int           fd_     = -1;
+    record      * record_ = nullptr;
+    size_t        depth_  = 0;
+    bool          locked_ = false;
+};
@@ -0,0 +1,189 @@
+#include "lobera_usb.hpp"
+#include "lobera_arena.hpp"
+#include "lobera_codec.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_simd.hpp"
+#include "lobera_trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+
+//
+// Multi-profile apply.
+//
+// Writes can't be interleaved between profiles, so they go strictly in
+// order: keys offsets, data batches, repeats, finalize, then thumbs.
+// Verification reads of already written blocks are slotted into any write
+// cool-down that admits reads. Every write keeps the read cool-down its
+// single-profile counterpart uses, which is as long as the write one, so
+// reads mostly queue up behind the last write.
+//
+namespace
+{
+    struct pipeline_step
+    {
+        bool            write;
+        uint8_t         req_type;
+        uint16_t        value;
+        uint16_t        index;
+        uint8_t const * out;      // write payload or expected read data
+        size_t          size;
+        uint64_t        next_write_ms;
+        uint64_t        next_read_ms;
+        size_t          job;      // index of the profile in the apply
+    };
+
+    struct prepared_profile
+    {
+        uint8_t                   profile;
+        lobera_usb::profile_image image;
+        std::vector<uint8_t>      thumbs;
+        uint8_t                   thumb_enabled[3];
+    };
+}
+
+lobera_usb::apply_report lobera_usb::apply_profiles(std::vector<profile_config> const & profiles, bool verify)
+{
+    LOBERA_TRACE_OP("apply_profiles");
+    apply_report report;
+
+    // Encode everything before touching the device
+    auto prepare_start = std::chrono::steady_clock::now();
+    std::vector<prepared_profile> prepared;
+    prepared.reserve(profiles.size());
+    for (auto const & config: profiles)
+    {
+        if ((config.profile < 1) || (config.profile > 5))
+            throw std::runtime_error("Invalid profile number");
+
+        prepared_profile p;
+        p.profile = config.profile;
+        p.image = compile_profile_image(config.keys);
+        p.thumbs.assign(BATCH_SIZE, 0);
+        for (size_t ithumb = 0; ithumb < 3; ++ithumb)
+        {
+            if (lobera_codec::encode_macro_entries(config.thumbs[ithumb], nullptr, 0) > THUMB_MAX_MACRO)
+                throw std::runtime_error("Macro is too large");
+            lobera_codec::encode_macro_entries(config.thumbs[ithumb], p.thumbs.data() + ithumb * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+            p.thumb_enabled[ithumb] = config.thumbs[ithumb].empty() ? 0 : 1;
+        }
+        prepared.push_back(std::move(p));
+    }
+
+    std::deque<pipeline_step> writes, reads;
+    for (size_t job = 0; job < prepared.size(); ++job)
+    {
+        prepared_profile const & p = prepared[job];
+        size_t num_batches = p.image.data.size() / BATCH_SIZE;
+
+        writes.push_back({true, W_KEYS_OFFSETS, 0, p.profile, p.image.offsets.data(), p.image.offsets.size(), 500, 500, job});
+        for (size_t batch_num = 0; batch_num < num_batches; ++batch_num)
+        {
+            uint16_t index = (batch_num << 8) | p.profile;
+            writes.push_back({true, W_KEYS_DATA, 0, index, p.image.data.data() + batch_num * BATCH_SIZE, BATCH_SIZE, 4000, 4000, job});
+        }
+        writes.push_back({true, W_KEYS_REPEATS, 0, p.profile, p.image.repeats.data(), p.image.repeats.size(), 1000, 1000, job});
+        writes.push_back({true, W_FINILIZE, 0, 0, nullptr, 0, 0, 0, job});
+
+        writes.push_back({true, W_THUMBS_MACROS, 0, p.profile, p.thumbs.data(), p.thumbs.size(), 1500, 1500, job});
+        for (uint16_t ithumb = 1; ithumb <= 3; ++ithumb)
+            writes.push_back({true, W_THUMB_ENABLED, static_cast<uint16_t>(ithumb | (p.thumb_enabled[ithumb - 1] ? 0x0100 : 0x0000)), p.profile, nullptr, 0, 500, 500, job});
+    }
+    report.prepare_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - prepare_start).count();
+
+    // Verification reads of a profile become available once its writes are done
+    auto queue_verify = [&](size_t job) {
+        prepared_profile const & p = prepared[job];
+        size_t num_batches = p.image.data.size() / BATCH_SIZE;
+        reads.push_back({false, R_KEYS_OFFSETS, 0, p.profile, p.image.offsets.data(), p.image.offsets.size(), 0, 0, job});
+        for (size_t batch_num = 0; batch_num < num_batches; ++batch_num)
+        {
+            uint16_t index = (batch_num << 8) | p.profile;
+            reads.push_back({false, R_KEYS_DATA, 0, index, p.image.data.data() + batch_num * BATCH_SIZE, BATCH_SIZE, 0, 0, job});
+        }
+        reads.push_back({false, R_KEYS_REPEATS, 0, p.profile, p.image.repeats.data(), p.image.repeats.size(), 0, 0, job});
+        reads.push_back({false, R_THUMBS_MACROS, 0, p.profile, p.thumbs.data(), p.thumbs.size(), 0, 0, job});
+        for (uint16_t ithumb = 1; ithumb <= 3; ++ithumb)
+            reads.push_back({false, R_THUMB_ENABLED, ithumb, p.profile, &p.thumb_enabled[ithumb - 1], 1, 0, 0, job});
+    };
+
+    // Run
+    uint64_t start = clock_ms();
+    size_t write_gate = SIZE_MAX, read_gate = SIZE_MAX;
+    std::vector<size_t> gate;
+    uint8_t * buf = arena_->block;
+
+    auto issue = [&](pipeline_step const & step) {
+        uint64_t now = clock_ms();
+        uint64_t ready = step.write ? next_write_ : next_read_;
+        uint64_t prev_write = next_write_, prev_read = next_read_;
+        size_t i = report.transfers.size();
+
+        gate.push_back((now < ready) ? (step.write ? write_gate : read_gate) : ((i > 0) ? i - 1 : SIZE_MAX));
+        report.transfers.push_back(transfer{step.write, step.req_type, step.value, step.index, step.size,
+                                            std::max(now, ready) - start, step.next_write_ms, step.next_read_ms});
+
+        if (step.write)
+            write_data(step.req_type, step.value, step.index, step.out, step.size, step.next_write_ms, step.next_read_ms);
+        else
+        {
+            size_t sz = read_data(step.req_type, step.value, step.index, buf, step.size, step.next_write_ms, step.next_read_ms);
+            bool ok = (sz == step.size) && lobera_simd::equal(buf, step.out, step.size);
+            uint8_t profile = prepared[step.job].profile;
+            if (!ok && (report.mismatches.empty() || (report.mismatches.back() != profile)))
+                report.mismatches.push_back(profile);
+        }
+
+        if (next_write_ != prev_write)
+            write_gate = i;
+        if (next_read_ != prev_read)
+            read_gate = i;
+    };
+
+    pacing_hold hold(*this);
+    discard_checkpoint();
+    try
+    {
+        while (!writes.empty())
+        {
+            // Fill write cool-down with reads while the device accepts them
+            while (!reads.empty() && (clock_ms() < next_write_) && (clock_ms() >= next_read_))
+            {
+                issue(reads.front());
+                reads.pop_front();
+            }
+
+            issue(writes.front());
+            pipeline_step step = writes.front();
+            writes.pop_front();
+
+            if (verify && (writes.empty() || (writes.front().job != step.job)))
+                queue_verify(step.job);
+        }
+    }
+    catch (...)
+    {
+        // Failed and remaining writes become the checkpoint for resume(),
+        // verification reads are dropped
+        for (auto const & step: writes)
+            checkpoint_.push(step.req_type, step.value, step.index, step.out, step.size, step.next_write_ms, step.next_read_ms);
+        for (auto const & config: profiles)
+            publish_keys(config.profile, nullptr);
+        throw;
+    }
+    for (; !reads.empty(); reads.pop_front())
+        issue(reads.front());
+
+    for (auto const & config: profiles)
+    {
+        bool mismatch = std::find(report.mismatches.begin(), report.mismatches.end(), config.profile) != report.mismatches.end();
+        publish_keys(config.profile, mismatch ? nullptr : &config.keys);
+    }
+
+    report.duration_ms = clock_ms() - start;
+    for (size_t i = report.transfers.size() - 1; i != SIZE_MAX; i = gate[i])
+        report.critical_path.insert(report.critical_path.begin(), i);
+    return report;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#define VENDOR_ID        0x195d
+
+#define BATCH_SIZE       4096
+#define OFFSETS_SIZE     575
+#define REPEAT_SIZE      228
+#define THUMB_MAX_MACRO  1024
+
+#define MAX_KEYS         ((OFFSETS_SIZE - 5) / 5)
+#define MAX_DATA_SIZE    0xffff
+
+#define KEY_CODE_DISABLE 0x8c
+
+// Rough duration of a full speed control transfer, used by dry runs
+#define EST_TRANSFER_MS(size) (1 + (size) / 512)
+
+#define W_FINILIZE       0x14
+#define R_PROFILE        0x15
+#define W_PROFILE        0x14
+#define R_STATUS         0x04
+#define W_LIGHT_MODE     0x31
+#define R_COLORS         0x33
+#define W_COLORS         0x32
+#define R_THUMBS_MACROS  0x51
+#define W_THUMBS_MACROS  0x50
+#define R_THUMB_ENABLED  0x53
+#define W_THUMB_ENABLED  0x52
+#define R_KEYS_OFFSETS   0x11
+#define W_KEYS_OFFSETS   0x10
+#define R_KEYS_DATA      0x13
+#define W_KEYS_DATA      0x12
+#define R_KEYS_REPEATS   0x17
+#define W_KEYS_REPEATS   0x16
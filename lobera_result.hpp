@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+//
+// Error codes of the noexcept (try_*) API. The throwing API is built on top
+// of it and turns an error into std::runtime_error with the same text
+//
+enum struct lobera_errc: uint8_t
+{
+    OK,
+    BROKEN_MACRO,            // macro record runs past the end of its data
+    BROKEN_OFFSETS,          // offset entry, or the data it points to, is cut short
+    BROKEN_REPEATS,          // repeat record runs past the end of the table
+    UNKNOWN_REPEAT_MODE,     // detail: mode byte
+    UNKNOWN_MACRO_CODE,      // detail: code byte
+    UNKNOWN_OFFSET_CODE,     // detail: code byte
+    UNKNOWN_RECORD_TYPE,     // detail: offset entry op
+    UNKNOWN_SETTING_TYPE,    // detail: type
+    INVALID_MACRO_OPERATION, // detail: macro entry type
+    WRONG_ENTRY_TYPE,        // macro_entry accessor doesn't match the entry type
+    WRONG_SETTING_TYPE,      // key_setting accessor doesn't match the setting type
+    MACRO_TOO_LARGE,
+    TOO_MANY_KEYS,
+    INVALID_IMAGE,
+    OUT_OF_MEMORY,
+    READ_FAILED,             // detail: libusb return code
+    WRITE_FAILED,            // detail: libusb return code
+};
+
+struct lobera_error
+{
+    lobera_errc code   = lobera_errc::OK;
+    int32_t     detail = 0;
+};
+
+inline char const * lobera_strerror(lobera_errc code)
+{
+    switch (code)
+    {
+        case lobera_errc::OK:                      return "Success";
+        case lobera_errc::BROKEN_MACRO:            return "Broken macro data";
+        case lobera_errc::BROKEN_OFFSETS:          return "Broken offsets data";
+        case lobera_errc::BROKEN_REPEATS:          return "Broken repeats data";
+        case lobera_errc::UNKNOWN_REPEAT_MODE:     return "Unknown macro repeat mode";
+        case lobera_errc::UNKNOWN_MACRO_CODE:      return "Unknown macro code";
+        case lobera_errc::UNKNOWN_OFFSET_CODE:     return "Unknown offset entry code";
+        case lobera_errc::UNKNOWN_RECORD_TYPE:     return "Unknown record type";
+        case lobera_errc::UNKNOWN_SETTING_TYPE:    return "Unknown key setting type";
+        case lobera_errc::INVALID_MACRO_OPERATION: return "Invalid macro operation";
+        case lobera_errc::WRONG_ENTRY_TYPE:        return "Invalid macro entry type";
+        case lobera_errc::WRONG_SETTING_TYPE:      return "Invalid key setting type";
+        case lobera_errc::MACRO_TOO_LARGE:         return "Macro is too large";
+        case lobera_errc::TOO_MANY_KEYS:           return "Too many keys";
+        case lobera_errc::INVALID_IMAGE:           return "Invalid profile image";
+        case lobera_errc::OUT_OF_MEMORY:           return "Out of memory";
+        case lobera_errc::READ_FAILED:             return "Error reading data";
+        case lobera_errc::WRITE_FAILED:            return "Error writing data";
+    }
+    return "Unknown error";
+}
+
+// Message the throwing API uses, with the detail for the codes that have one
+inline std::string lobera_error_message(lobera_error const & error)
+{
+    std::string msg = lobera_strerror(error.code);
+    switch (error.code)
+    {
+        case lobera_errc::UNKNOWN_REPEAT_MODE:
+        case lobera_errc::UNKNOWN_MACRO_CODE:
+        case lobera_errc::UNKNOWN_OFFSET_CODE:
+        case lobera_errc::UNKNOWN_RECORD_TYPE:
+        case lobera_errc::UNKNOWN_SETTING_TYPE:
+        case lobera_errc::INVALID_MACRO_OPERATION:
+        case lobera_errc::READ_FAILED:
+        case lobera_errc::WRITE_FAILED:
+            msg += ": " + std::to_string(error.detail);
+            break;
+        default:
+            break;
+    }
+    return msg;
+}
+
+[[noreturn]] inline void lobera_throw(lobera_error const & error)
+{
+    throw std::runtime_error(lobera_error_message(error));
+}
+
+//
+// Value or error, a small std::expected
+//
+template <typename T>
+class lobera_result
+{
+public:
+    lobera_result(T const & value) noexcept(std::is_nothrow_copy_constructible<T>::value)
+        : has_value_(true)
+    {   new (&value_) T(value);   }
+
+    lobera_result(T && value) noexcept(std::is_nothrow_move_constructible<T>::value)
+        : has_value_(true)
+    {   new (&value_) T(std::move(value));   }
+
+    lobera_result(lobera_error const & error) noexcept
+        : has_value_(false)
+        , error_(error)
+    {   }
+
+    lobera_result(lobera_errc code, int32_t detail = 0) noexcept
+        : has_value_(false)
+        , error_{code, detail}
+    {   }
+
+    lobera_result(lobera_result const & r)
+        : has_value_(r.has_value_)
+    {
+        if (has_value_)
+            new (&value_) T(r.value_);
+        else
+            error_ = r.error_;
+    }
+
+    lobera_result(lobera_result && r) noexcept(std::is_nothrow_move_constructible<T>::value)
+        : has_value_(r.has_value_)
+    {
+        if (has_value_)
+            new (&value_) T(std::move(r.value_));
+        else
+            error_ = r.error_;
+    }
+
+    ~lobera_result()
+    {
+        if (has_value_)
+            value_.~T();
+    }
+
+    lobera_result & operator=(lobera_result const &) = delete;
+    lobera_result & operator=(lobera_result &&) = delete;
+
+    bool has_value() const noexcept
+    {   return has_value_;   }
+
+    explicit operator bool() const noexcept
+    {   return has_value_;   }
+
+    lobera_error const & error() const noexcept
+    {   return error_;   }
+
+    lobera_errc code() const noexcept
+    {   return has_value_ ? lobera_errc::OK : error_.code;   }
+
+    // Throws std::runtime_error on error
+    T & value() &
+    {
+        if (!has_value_)
+            lobera_throw(error_);
+        return value_;
+    }
+
+    T const & value() const &
+    {
+        if (!has_value_)
+            lobera_throw(error_);
+        return value_;
+    }
+
+    T && value() &&
+    {
+        if (!has_value_)
+            lobera_throw(error_);
+        return std::move(value_);
+    }
+
+    // Unchecked access
+    T & operator*() noexcept
+    {   return value_;   }
+
+    T const & operator*() const noexcept
+    {   return value_;   }
+
+    T * operator->() noexcept
+    {   return &value_;   }
+
+    T const * operator->() const noexcept
+    {   return &value_;   }
+
+private:
+    bool has_value_;
+    union
+    {
+        lobera_error error_;
+        T            value_;
+    };
+};
+
+template <>
+class lobera_result<void>
+{
+public:
+    lobera_result() noexcept
+    {   }
+
+    lobera_result(lobera_error const & error) noexcept
+        : error_(error)
+    {   }
+
+    lobera_result(lobera_errc code, int32_t detail = 0) noexcept
+        : error_{code, detail}
+    {   }
+
+    bool has_value() const noexcept
+    {   return error_.code == lobera_errc::OK;   }
+
+    explicit operator bool() const noexcept
+    {   return has_value();   }
+
+    lobera_error const & error() const noexcept
+    {   return error_;   }
+
+    lobera_errc code() const noexcept
+    {   return error_.code;   }
+
+    void value() const
+    {
+        if (!has_value())
+            lobera_throw(error_);
+    }
+
+private:
+    lobera_error error_;
+};
@@ -0,0 +1,216 @@
+#include "lobera_sim.hpp"
+#include "lobera_protocol.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace
+{
+    // Cool-down the device needs after a write, as (write, read) ms
+    std::pair<uint64_t, uint64_t> device_cooldown(uint8_t req_type, uint16_t value)
+    {
+        switch (req_type)
+        {
+            case W_PROFILE:       return (value != 0) ? std::make_pair(500, 500) : std::make_pair(0, 0);
+            case W_LIGHT_MODE:    return {500, 500};
+            case W_COLORS:        return {500, 0};
+            case W_THUMBS_MACROS: return {1500, 0};
+            case W_THUMB_ENABLED: return {500, 0};
+            case W_KEYS_OFFSETS:  return {500, 500};
+            case W_KEYS_DATA:     return {4000, 4000};
+            case W_KEYS_REPEATS:  return {1000, 1000};
+        }
+        return {0, 0};
+    }
+}
+
+lobera_sim::lobera_sim(bool model_pacing)
+    : model_pacing_(model_pacing)
+{
+    colors_.fill(0);
+    for (auto & profile: profiles_)
+    {
+        profile.offsets.assign(OFFSETS_SIZE, 0);
+        profile.data.assign(256 * BATCH_SIZE, 0);
+        profile.repeats.assign(REPEAT_SIZE, 0);
+        profile.thumbs.assign(BATCH_SIZE, 0);
+        profile.thumb_enabled.fill(0);
+    }
+
+    // Factory state is what reset writes, long enough ago for any cool-down to pass
+    reset_config(true);
+    idle(60000);
+    reset_stats();
+}
+
+lobera_sim::profile_memory & lobera_sim::memory(uint8_t profile)
+{
+    if ((profile < 1) || (profile > 5))
+        throw std::runtime_error("Invalid profile number");
+    return profiles_[profile - 1];
+}
+
+void lobera_sim::reset_stats()
+{
+    stats_       = stats{};
+    stats_start_ = clock_;
+}
+
+int lobera_sim::control_msg(int         request_type,
+                            uint8_t     req_type,
+                            uint16_t    value,
+                            uint16_t    index,
+                            void      * data,
+                            size_t      size)
+{
+    if (fail_count_ > 0)
+    {
+        if (fail_after_ == 0)
+        {
+            --fail_count_;
+            return -EIO;
+        }
+        --fail_after_;
+    }
+
+    bool is_write = (request_type == 0x40);
+    uint64_t start = clock_;
+    if (model_pacing_)
+    {
+        if (start < (is_write ? write_ready_ : read_ready_))
+            ++stats_.violations;
+        clock_ += EST_TRANSFER_MS(size);
+    }
+
+    if (!is_write)
+    {
+        ++stats_.reads;
+        stats_.bytes_read += size;
+        return read(req_type, value, index, static_cast<uint8_t *>(data), size);
+    }
+
+    ++stats_.writes;
+    stats_.bytes_written += size;
+    auto cooldown = device_cooldown(req_type, value);
+    write_ready_ = std::max(write_ready_, start + cooldown.first);
+    read_ready_  = std::max(read_ready_,  start + cooldown.second);
+    return write(req_type, value, index, static_cast<uint8_t const *>(data), size);
+}
+
+uint64_t lobera_sim::clock_ms()
+{
+    return clock_;
+}
+
+void lobera_sim::sleep_ms(uint64_t ms)
+{
+    stats_.slept_ms += ms;
+    if (model_pacing_)
+        clock_ += ms;
+}
+
+int lobera_sim::read(uint8_t req_type, uint16_t value, uint16_t index, uint8_t * data, size_t size)
+{
+    auto copy = [&](uint8_t const * src, size_t src_size) {
+        size_t n = std::min(size, src_size);
+        std::memcpy(data, src, n);
+        return static_cast<int>(n);
+    };
+
+    uint8_t profile = index & 0xff;
+    switch (req_type)
+    {
+        case R_PROFILE:
+            return copy(&profile_, 1);
+
+        case R_STATUS:
+        {
+            uint8_t status[16] = {0};
+            status[1] = 0xff;
+            status[4] = static_cast<uint8_t>(light_mode_);
+            return copy(status, sizeof(status));
+        }
+
+        case R_COLORS:
+            return copy(colors_.data(), colors_.size());
+    }
+
+    if ((profile < 1) || (profile > 5))
+        return -EINVAL;
+    profile_memory & mem = profiles_[profile - 1];
+
+    switch (req_type)
+    {
+        case R_THUMBS_MACROS:
+            return copy(mem.thumbs.data(), mem.thumbs.size());
+
+        case R_THUMB_ENABLED:
+            if ((value < 1) || (value > 3))
+                return -EINVAL;
+            return copy(&mem.thumb_enabled[value - 1], 1);
+
+        case R_KEYS_OFFSETS:
+            return copy(mem.offsets.data(), mem.offsets.size());
+
+        case R_KEYS_DATA:
+            return copy(mem.data.data() + (index >> 8) * BATCH_SIZE, BATCH_SIZE);
+
+        case R_KEYS_REPEATS:
+            return copy(mem.repeats.data(), mem.repeats.size());
+    }
+    return -EINVAL;
+}
+
+int lobera_sim::write(uint8_t req_type, uint16_t value, uint16_t index, uint8_t const * data, size_t size)
+{
+    auto copy = [&](std::vector<uint8_t> & dst, size_t offset, size_t dst_size) {
+        size_t n = std::min(size, dst_size);
+        std::memcpy(dst.data() + offset, data, n);
+        return static_cast<int>(n);
+    };
+
+    uint8_t profile = index & 0xff;
+    switch (req_type)
+    {
+        case W_PROFILE: // also W_FINILIZE
+            if (value != 0)
+                profile_ = value;
+            return 0;
+
+        case W_LIGHT_MODE:
+            light_mode_ = static_cast<light_mode>(value);
+            return 0;
+
+        case W_COLORS:
+            std::memcpy(colors_.data(), data, std::min(size, colors_.size()));
+            return static_cast<int>(std::min(size, colors_.size()));
+    }
+
+    if ((profile < 1) || (profile > 5))
+        return -EINVAL;
+    profile_memory & mem = profiles_[profile - 1];
+    ++stats_.profile_writes[profile - 1];
+
+    switch (req_type)
+    {
+        case W_THUMBS_MACROS:
+            return copy(mem.thumbs, 0, mem.thumbs.size());
+
+        case W_THUMB_ENABLED:
+            if (((value & 0xff) < 1) || ((value & 0xff) > 3))
+                return -EINVAL;
+            mem.thumb_enabled[(value & 0xff) - 1] = (value >> 8) ? 1 : 0;
+            return 0;
+
+        case W_KEYS_OFFSETS:
+            return copy(mem.offsets, 0, mem.offsets.size());
+
+        case W_KEYS_DATA:
+            return copy(mem.data, (index >> 8) * BATCH_SIZE, BATCH_SIZE);
+
+        case W_KEYS_REPEATS:
+            return copy(mem.repeats, 0, mem.repeats.size());
+    }
+    return -EINVAL;
+}
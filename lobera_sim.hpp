@@ -0,0 +1,92 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+#include <array>
+
+//
+// In-memory model of the keyboard, for tests and benchmarks.
+//
+// Time is virtual: transfers cost an estimated USB time, pacing sleeps
+// advance the clock (or are skipped when pacing isn't modeled), nothing
+// actually sleeps. Device memory starts in the reset_config() state.
+//
+class lobera_sim: public lobera_usb
+{
+public:
+    struct profile_memory
+    {
+        std::vector<uint8_t> offsets;
+        std::vector<uint8_t> data;          // all 256 batches
+        std::vector<uint8_t> repeats;
+        std::vector<uint8_t> thumbs;
+        std::array<uint8_t, 3> thumb_enabled;
+    };
+
+    struct stats
+    {
+        size_t                  reads          = 0;
+        size_t                  writes         = 0;
+        size_t                  bytes_read     = 0;
+        size_t                  bytes_written  = 0;
+        size_t                  violations     = 0;  // transfers that came during device cool-down
+        std::array<size_t, 5>   profile_writes = {}; // writes to each profile's memory
+        uint64_t                slept_ms       = 0;
+    };
+
+public:
+    explicit lobera_sim(bool model_pacing = true);
+
+    profile_memory & memory(uint8_t profile);
+    std::array<uint8_t, 18> & colors()
+    {   return colors_;   }
+
+    // Device time since construction or reset_stats()
+    uint64_t elapsed_ms() const
+    {   return clock_ - stats_start_;   }
+
+    // Lets device time pass without transfers
+    void idle(uint64_t ms)
+    {   clock_ += ms;   }
+
+    stats const & get_stats() const
+    {   return stats_;   }
+
+    void reset_stats();
+
+    // Makes `count` transfers fail with EIO after `after` more succeed
+    void fail_transfers(size_t after, size_t count = 1)
+    {
+        fail_after_ = after;
+        fail_count_ = count;
+    }
+
+protected:
+    int control_msg(int         request_type,
+                    uint8_t     req_type,
+                    uint16_t    value,
+                    uint16_t    index,
+                    void      * data,
+                    size_t      size) override;
+    uint64_t clock_ms() override;
+    void sleep_ms(uint64_t ms) override;
+
+private:
+    int read(uint8_t req_type, uint16_t value, uint16_t index, uint8_t * data, size_t size);
+    int write(uint8_t req_type, uint16_t value, uint16_t index, uint8_t const * data, size_t size);
+
+private:
+    bool                        model_pacing_;
+    uint64_t                    clock_       = 0;
+    uint64_t                    stats_start_ = 0;
+    uint64_t                    read_ready_  = 0;
+    uint64_t                    write_ready_ = 0;
+    stats                       stats_;
+    size_t                      fail_after_  = 0;
+    size_t                      fail_count_  = 0;
+
+    uint8_t                     profile_     = 1;
+    light_mode                  light_mode_  = light_mode::SINGLE;
+    std::array<uint8_t, 18>     colors_;
+    std::array<profile_memory, 5> profiles_;
+};
@@ -0,0 +1,168 @@
+#include "lobera_simd.hpp"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LOBERA_SIMD_AVX2
+#define LOBERA_SIMD_WIDTH 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LOBERA_SIMD_SSE2
+#define LOBERA_SIMD_WIDTH 16
+#endif
+
+namespace
+{
+#if defined(LOBERA_SIMD_AVX2)
+    typedef uint32_t mask_t;
+
+    inline __m256i load(uint8_t const * p)
+    {   return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));   }
+
+    // Bit i set where a[i] == b[i]
+    inline mask_t eq_mask(uint8_t const * a, uint8_t const * b)
+    {   return static_cast<mask_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(load(a), load(b))));   }
+
+    inline mask_t byte_mask(uint8_t const * p, uint8_t value)
+    {   return static_cast<mask_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(load(p), _mm256_set1_epi8(static_cast<char>(value)))));   }
+
+    inline bool zero_block(uint8_t const * p)
+    {
+        __m256i v = load(p);
+        return _mm256_testz_si256(v, v) != 0;
+    }
+#elif defined(LOBERA_SIMD_SSE2)
+    typedef uint32_t mask_t;
+
+    inline __m128i load(uint8_t const * p)
+    {   return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));   }
+
+    inline mask_t eq_mask(uint8_t const * a, uint8_t const * b)
+    {   return static_cast<mask_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(load(a), load(b))));   }
+
+    inline mask_t byte_mask(uint8_t const * p, uint8_t value)
+    {   return static_cast<mask_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(load(p), _mm_set1_epi8(static_cast<char>(value)))));   }
+
+    inline bool zero_block(uint8_t const * p)
+    {   return _mm_movemask_epi8(_mm_cmpeq_epi8(load(p), _mm_setzero_si128())) == 0xffff;   }
+#endif
+
+#if defined(LOBERA_SIMD_WIDTH)
+    constexpr mask_t FULL_MASK = static_cast<mask_t>((1ull << LOBERA_SIMD_WIDTH) - 1);
+
+    inline size_t lowest_bit(uint64_t m)
+    {   return static_cast<size_t>(__builtin_ctzll(m));   }
+
+    // Bit i set where data[i] == 0, for 64 bytes
+    inline uint64_t zero_mask64(uint8_t const * p)
+    {
+        uint64_t m = 0;
+        for (size_t i = 0; i < 64; i += LOBERA_SIMD_WIDTH)
+            m |= static_cast<uint64_t>(byte_mask(p + i, 0)) << i;
+        return m;
+    }
+#endif
+}
+
+namespace lobera_simd
+{
+    char const * implementation()
+    {
+#if defined(LOBERA_SIMD_AVX2)
+        return "avx2";
+#elif defined(LOBERA_SIMD_SSE2)
+        return "sse2";
+#else
+        return "scalar";
+#endif
+    }
+
+    size_t first_difference(uint8_t const * a, uint8_t const * b, size_t size)
+    {
+        size_t i = 0;
+#if defined(LOBERA_SIMD_WIDTH)
+        for (; i + LOBERA_SIMD_WIDTH <= size; i += LOBERA_SIMD_WIDTH)
+        {
+            mask_t m = eq_mask(a + i, b + i);
+            if (m != FULL_MASK)
+                return i + lowest_bit(~m & FULL_MASK);
+        }
+#endif
+        for (; i < size; ++i)
+        {
+            if (a[i] != b[i])
+                return i;
+        }
+        return size;
+    }
+
+    bool all_zero(uint8_t const * data, size_t size)
+    {
+        size_t i = 0;
+#if defined(LOBERA_SIMD_WIDTH)
+        for (; i + LOBERA_SIMD_WIDTH <= size; i += LOBERA_SIMD_WIDTH)
+        {
+            if (!zero_block(data + i))
+                return false;
+        }
+#endif
+        for (; i < size; ++i)
+        {
+            if (data[i] != 0)
+                return false;
+        }
+        return true;
+    }
+
+    size_t find_byte(uint8_t const * data, size_t size, uint8_t value)
+    {
+        size_t i = 0;
+#if defined(LOBERA_SIMD_WIDTH)
+        for (; i + LOBERA_SIMD_WIDTH <= size; i += LOBERA_SIMD_WIDTH)
+        {
+            mask_t m = byte_mask(data + i, value);
+            if (m != 0)
+                return i + lowest_bit(m);
+        }
+#endif
+        for (; i < size; ++i)
+        {
+            if (data[i] == value)
+                return i;
+        }
+        return size;
+    }
+
+    size_t find_zero_record(uint8_t const * data, size_t size, size_t stride)
+    {
+        if (stride <= 1)
+            return find_byte(data, size, 0);
+
+        size_t i = 0;
+#if defined(LOBERA_SIMD_WIDTH)
+        if (stride < 64)
+        {
+            // Record starts within a 64 byte block: the lattice for phase 0
+            // shifted by the offset of the first record in the block
+            uint64_t lattice = 0;
+            for (size_t k = 0; k < 64; k += stride)
+                lattice |= 1ull << k;
+
+            size_t phase = 0; // offset of the first record start in the block
+            for (; i + 64 <= size; i += 64)
+            {
+                uint64_t m = zero_mask64(data + i) & (lattice << phase);
+                if (m != 0)
+                    return i + lowest_bit(m);
+                phase = (phase + stride - 64 % stride) % stride;
+            }
+            i += phase;
+        }
+#endif
+        for (; i < size; i += stride)
+        {
+            if (data[i] == 0)
+                return i;
+        }
+        return size;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//
+// Byte kernels for batches and tables. AVX2 when built with -mavx2 (or
+// -march=native), SSE2 otherwise on x86-64, plain loops elsewhere.
+//
+namespace lobera_simd
+{
+    // Name of the compiled-in implementation: "avx2", "sse2" or "scalar"
+    char const * implementation();
+
+    // Offset of the first differing byte, size if equal
+    size_t first_difference(uint8_t const * a, uint8_t const * b, size_t size);
+
+    inline bool equal(uint8_t const * a, uint8_t const * b, size_t size)
+    {   return first_difference(a, b, size) == size;   }
+
+    bool all_zero(uint8_t const * data, size_t size);
+
+    // Offset of the first byte equal to value, size if none
+    size_t find_byte(uint8_t const * data, size_t size, uint8_t value);
+
+    // Offset of the first zero byte at a multiple of stride (the terminator
+    // of a table of fixed size records), size if none
+    size_t find_zero_record(uint8_t const * data, size_t size, size_t stride);
+}
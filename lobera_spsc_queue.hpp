@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+//
+// Bounded lock-free queue for one producer thread and one consumer thread
+//
+template<class T, size_t N>
+class lobera_spsc_queue
+{
+    static_assert((N & (N - 1)) == 0, "Queue size must be a power of 2");
+
+public:
+    // Producer side, returns false if the queue is full
+    bool try_push(T const & v)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == N)
+            return false;
+        items_[tail & (N - 1)] = v;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, returns false if the queue is empty
+    bool try_pop(T & v)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+        v = items_[head & (N - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    std::array<T, N>                items_;
+};
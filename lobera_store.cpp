@@ -0,0 +1,337 @@
+#include "lobera_store.hpp"
+#include "lobera_codec.hpp"
+#include "lobera_hash.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STORE_MAGIC       "LBPS"
+#define STORE_VERSION     1
+#define STORE_HEADER_SIZE 16
+#define STORE_ENTRY_SIZE  32
+
+//
+// Store file, numbers are big endian:
+//
+//   header   magic, version, 3 zero bytes, count (4), 4 zero bytes
+//   entries  count x 32 bytes, in name order:
+//              name offset (4), name size (2), data batches (2), hash (8),
+//              record offset (8), thumb enabled flags (3), has thumbs (1),
+//              4 zero bytes
+//   hashes   count x 4 bytes, entry numbers in hash order
+//   names
+//   records  offsets table, repeats table, data batches, thumbs block if
+//            it has thumbs
+//
+namespace
+{
+    uint8_t const ZERO_THUMBS[BATCH_SIZE] = {0};
+
+    uint64_t get_be(uint8_t const * p, size_t size)
+    {
+        uint64_t v = 0;
+        for (size_t i = 0; i < size; ++i)
+            v = (v << 8) | p[i];
+        return v;
+    }
+
+    void put_be(std::vector<uint8_t> & out, uint64_t v, size_t size)
+    {
+        for (size_t i = size; i > 0; --i)
+            out.push_back(static_cast<uint8_t>(v >> ((i - 1) * 8)));
+    }
+
+    uint64_t hash_record(lobera_usb::profile_image const & image, std::vector<uint8_t> const & thumbs, uint8_t const * thumb_enabled)
+    {
+        fnv1a h;
+        h.add(image.offsets.data(), image.offsets.size());
+        h.add(image.repeats.data(), image.repeats.size());
+        h.add(image.data.data(), image.data.size());
+        h.add(thumb_enabled, 3);
+        h.add(thumbs.data(), thumbs.size());
+        return h.h;
+    }
+
+    std::runtime_error corrupt()
+    {
+        return std::runtime_error("Corrupt profile store");
+    }
+}
+
+//
+// Store
+//
+lobera_profile_store::lobera_profile_store(std::string const & path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Error opening profile store: " + path + " (" + std::strerror(errno) + ")");
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Error opening profile store: " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ < STORE_HEADER_SIZE)
+    {
+        ::close(fd);
+        throw std::runtime_error("Invalid profile store file: " + path);
+    }
+
+    void * p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        throw std::runtime_error("Error mapping profile store: " + path + " (" + std::strerror(errno) + ")");
+    base_ = static_cast<uint8_t const *>(p);
+
+    // Entries are checked when used, so opening doesn't touch the index
+    count_ = get_be(base_ + 8, 4);
+    if ((std::memcmp(base_, STORE_MAGIC, 4) != 0) || (base_[4] != STORE_VERSION)
+        || (STORE_HEADER_SIZE + count_ * (STORE_ENTRY_SIZE + 4) > size_))
+    {
+        ::munmap(const_cast<uint8_t *>(base_), size_);
+        throw std::runtime_error("Invalid profile store file: " + path);
+    }
+}
+
+lobera_profile_store::~lobera_profile_store()
+{
+    ::munmap(const_cast<uint8_t *>(base_), size_);
+}
+
+lobera_profile_store::entry lobera_profile_store::at(size_t i) const
+{
+    if (i >= count_)
+        throw std::runtime_error("Invalid profile store entry: " + std::to_string(i));
+
+    uint8_t const * p = base_ + STORE_HEADER_SIZE + i * STORE_ENTRY_SIZE;
+    size_t name_offset = get_be(p, 4);
+    size_t name_size   = get_be(p + 4, 2);
+    size_t num_batches = get_be(p + 6, 2);
+    uint64_t record    = get_be(p + 16, 8);
+    bool has_thumbs    = p[27] != 0;
+
+    size_t record_size = OFFSETS_SIZE + REPEAT_SIZE + num_batches * BATCH_SIZE + (has_thumbs ? BATCH_SIZE : 0);
+    if ((name_offset + name_size > size_) || (num_batches == 0) || (record > size_) || (record_size > size_ - record))
+        throw corrupt();
+
+    entry e;
+    e.name = std::string_view(reinterpret_cast<char const *>(base_ + name_offset), name_size);
+    e.hash = get_be(p + 8, 8);
+    e.image.offsets   = base_ + record;
+    e.image.repeats   = base_ + record + OFFSETS_SIZE;
+    e.image.data      = base_ + record + OFFSETS_SIZE + REPEAT_SIZE;
+    e.image.data_size = num_batches * BATCH_SIZE;
+    e.image.thumbs    = has_thumbs ? e.image.data + e.image.data_size : ZERO_THUMBS;
+    std::memcpy(e.image.thumb_enabled, p + 24, 3);
+    return e;
+}
+
+bool lobera_profile_store::find(std::string_view name, entry & e) const
+{
+    size_t lo = 0, hi = count_;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        entry m = at(mid);
+        int c = m.name.compare(name);
+        if (c == 0)
+        {
+            e = m;
+            return true;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+bool lobera_profile_store::find_hash(uint64_t hash, entry & e) const
+{
+    uint8_t const * hashes = base_ + STORE_HEADER_SIZE + count_ * STORE_ENTRY_SIZE;
+    auto hash_of = [&](size_t k) {
+        size_t i = get_be(hashes + k * 4, 4);
+        if (i >= count_)
+            throw corrupt();
+        return get_be(base_ + STORE_HEADER_SIZE + i * STORE_ENTRY_SIZE + 8, 8);
+    };
+
+    size_t lo = 0, hi = count_;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (hash_of(mid) < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if ((lo == count_) || (hash_of(lo) != hash))
+        return false;
+    e = at(get_be(hashes + lo * 4, 4));
+    return true;
+}
+
+void lobera_profile_store::apply(lobera_usb & device, std::string_view name, uint8_t profile) const
+{
+    LOBERA_TRACE_OP("store_apply");
+    entry e;
+    if (!find(name, e))
+        throw std::runtime_error("Profile not in store: " + std::string(name));
+    device.write_profile_image(profile, e.image);
+}
+
+lobera_usb::keys_settings lobera_profile_store::decode_keys(entry const & e)
+{
+    std::vector<lobera_codec::offset_entry> offsets;
+    std::vector<lobera_codec::repeat_entry> repeats;
+    lobera_codec::try_decode_offset_entries(e.image.offsets, OFFSETS_SIZE, offsets).value();
+    lobera_codec::try_decode_repeat_entries(e.image.repeats, REPEAT_SIZE, repeats).value();
+    return lobera_codec::decode_keys_settings(offsets, repeats, e.image.data, e.image.data_size);
+}
+
+lobera_usb::macro lobera_profile_store::decode_thumb(entry const & e, uint8_t thumb)
+{
+    if ((thumb < 1) || (thumb > 3))
+        throw std::runtime_error("Invalid thumb button number");
+    if (e.image.thumb_enabled[thumb - 1] == 0)
+        return {};
+    return lobera_codec::decode_macro_entries(e.image.thumbs + (thumb - 1) * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+}
+
+//
+// Builder
+//
+void lobera_profile_store_builder::add(std::string                      const & name,
+                                       lobera_usb::keys_settings        const & keys,
+                                       std::array<lobera_usb::macro, 3> const & thumbs)
+{
+    add(name, lobera_usb::compile_profile_image(keys), thumbs);
+}
+
+void lobera_profile_store_builder::add(std::string                      const & name,
+                                       lobera_usb::profile_image        const & image,
+                                       std::array<lobera_usb::macro, 3> const & thumbs)
+{
+    if (name.empty() || (name.size() > 0xffff))
+        throw std::runtime_error("Invalid profile name");
+    if ((image.offsets.size() != OFFSETS_SIZE) || (image.repeats.size() != REPEAT_SIZE)
+        || image.data.empty() || ((image.data.size() % BATCH_SIZE) != 0))
+        throw std::runtime_error("Invalid profile image");
+    for (auto const & p: profiles_)
+    {
+        if (p.name == name)
+            throw std::runtime_error("Duplicate profile name: " + name);
+    }
+
+    stored s;
+    s.name  = name;
+    s.image = image;
+    for (size_t ithumb = 0; ithumb < 3; ++ithumb)
+    {
+        if (lobera_codec::encode_macro_entries(thumbs[ithumb], nullptr, 0) > THUMB_MAX_MACRO)
+            throw std::runtime_error("Macro is too large");
+        s.thumb_enabled[ithumb] = thumbs[ithumb].empty() ? 0 : 1;
+        if (!thumbs[ithumb].empty())
+        {
+            s.thumbs.resize(BATCH_SIZE, 0);
+            lobera_codec::encode_macro_entries(thumbs[ithumb], s.thumbs.data() + ithumb * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+        }
+    }
+    s.hash = hash_record(s.image, s.thumbs, s.thumb_enabled);
+    profiles_.push_back(std::move(s));
+}
+
+void lobera_profile_store_builder::save(std::string const & path) const
+{
+    std::vector<stored const *> by_name;
+    for (auto const & p: profiles_)
+        by_name.push_back(&p);
+    std::sort(by_name.begin(), by_name.end(), [](stored const * a, stored const * b) { return a->name < b->name; });
+
+    std::vector<uint32_t> by_hash(by_name.size());
+    for (size_t i = 0; i < by_hash.size(); ++i)
+        by_hash[i] = i;
+    std::stable_sort(by_hash.begin(), by_hash.end(), [&](uint32_t a, uint32_t b) { return by_name[a]->hash < by_name[b]->hash; });
+
+    // Layout
+    size_t pos = STORE_HEADER_SIZE + by_name.size() * (STORE_ENTRY_SIZE + 4);
+    std::vector<size_t> name_offsets, record_offsets;
+    for (auto const * p: by_name)
+    {
+        name_offsets.push_back(pos);
+        pos += p->name.size();
+    }
+    for (auto const * p: by_name)
+    {
+        record_offsets.push_back(pos);
+        pos += OFFSETS_SIZE + REPEAT_SIZE + p->image.data.size() + p->thumbs.size();
+    }
+    if (pos > 0xffffffffu)
+        throw std::runtime_error("Profile store is too large");
+
+    std::vector<uint8_t> out;
+    out.reserve(pos);
+    out.insert(out.end(), STORE_MAGIC, STORE_MAGIC + 4);
+    put_be(out, STORE_VERSION, 1);
+    put_be(out, 0, 3);
+    put_be(out, by_name.size(), 4);
+    put_be(out, 0, 4);
+    for (size_t i = 0; i < by_name.size(); ++i)
+    {
+        stored const & p = *by_name[i];
+        put_be(out, name_offsets[i], 4);
+        put_be(out, p.name.size(), 2);
+        put_be(out, p.image.data.size() / BATCH_SIZE, 2);
+        put_be(out, p.hash, 8);
+        put_be(out, record_offsets[i], 8);
+        out.insert(out.end(), p.thumb_enabled, p.thumb_enabled + 3);
+        put_be(out, p.thumbs.empty() ? 0 : 1, 1);
+        put_be(out, 0, 4);
+    }
+    for (uint32_t i: by_hash)
+        put_be(out, i, 4);
+    for (auto const * p: by_name)
+        out.insert(out.end(), p->name.begin(), p->name.end());
+    for (auto const * p: by_name)
+    {
+        out.insert(out.end(), p->image.offsets.begin(), p->image.offsets.end());
+        out.insert(out.end(), p->image.repeats.begin(), p->image.repeats.end());
+        out.insert(out.end(), p->image.data.begin(), p->image.data.end());
+        out.insert(out.end(), p->thumbs.begin(), p->thumbs.end());
+    }
+
+    // Write aside and rename, as the image cache does. Close errors count,
+    // a store truncated on flush must not replace the good one.
+    static std::atomic<uint64_t> tmp_counter{0};
+    std::string tmp = path + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(tmp_counter.fetch_add(1));
+    {
+        std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+        os.write(reinterpret_cast<char const *>(out.data()), out.size());
+        os.close();
+        if (!os)
+        {
+            std::remove(tmp.c_str());
+            throw std::runtime_error("Error writing profile store: " + tmp);
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("Error writing profile store: " + path);
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+#include <string_view>
+
+//
+// Library of stored profiles in one file: wire images and thumb blocks,
+// indexed by name and by content hash.
+//
+// The file is mapped read-only and used in place. Opening it only checks
+// the header, so it costs the same for ten profiles or ten thousand, and
+// processes opening the same file share its pages. Entries point into the
+// mapping and stay valid while the store is open.
+//
+
+class lobera_profile_store
+{
+public:
+    struct entry
+    {
+        std::string_view               name;
+        uint64_t                       hash;   // of the wire image and thumbs
+        lobera_usb::profile_image_view image;  // keys and thumbs, in the mapping
+    };
+
+public:
+    explicit lobera_profile_store(std::string const & path);
+    ~lobera_profile_store();
+
+    lobera_profile_store(lobera_profile_store const &) = delete;
+    lobera_profile_store & operator=(lobera_profile_store const &) = delete;
+
+    size_t size() const
+    {   return count_;   }
+
+    // Entries are in name order
+    entry at(size_t i) const;
+    bool find(std::string_view name, entry & e) const;
+    bool find_hash(uint64_t hash, entry & e) const;
+
+    // Writes keys and thumbs of a stored profile. The payloads are copied
+    // into the device's write queue, so resume() doesn't need the store open.
+    void apply(lobera_usb & device, std::string_view name, uint8_t profile) const;
+
+    // Decoded settings, for inspection and editing
+    static lobera_usb::keys_settings decode_keys(entry const & e);
+    static lobera_usb::macro decode_thumb(entry const & e, uint8_t thumb);
+
+private:
+    uint8_t const * base_ = nullptr;
+    size_t          size_ = 0;
+    size_t          count_ = 0;
+};
+
+// Builds a store file, profiles are encoded as they are added
+class lobera_profile_store_builder
+{
+public:
+    void add(std::string                      const & name,
+             lobera_usb::keys_settings        const & keys,
+             std::array<lobera_usb::macro, 3> const & thumbs = {});
+    void add(std::string                      const & name,
+             lobera_usb::profile_image        const & image,
+             std::array<lobera_usb::macro, 3> const & thumbs = {});
+
+    // Written aside and renamed, open stores keep the old mapping
+    void save(std::string const & path) const;
+
+private:
+    struct stored
+    {
+        std::string               name;
+        lobera_usb::profile_image image;
+        std::vector<uint8_t>      thumbs;   // empty if no thumb macros
+        uint8_t                   thumb_enabled[3];
+        uint64_t                  hash;
+    };
+
+    std::vector<stored> profiles_;
+};
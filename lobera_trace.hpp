@@ -0,0 +1,69 @@
+#pragma once
+
+//
+// Static tracepoints (USDT), provider "lobera". Built in only with
+// -DLOBERA_USDT (make USDT=1), which needs <sys/sdt.h> (systemtap-sdt-dev).
+// Without it every macro expands to nothing.
+//
+// Probes:
+//   read__start  (req_type, value, index, size, sleep_ms)
+//   read__done   (req_type, value, index, size, ret)
+//   write__start (req_type, value, index, size, sleep_ms)
+//   write__done  (req_type, value, index, size, ret)
+//   op__start    (name)
+//   op__done     (name, failed)
+//
+// sleep_ms is the pacing delay taken before the transfer, ret is the
+// libusb return code (or the size in dry-run mode).
+//
+// e.g. bpftrace -e 'usdt:./test:lobera:write__start /arg4 > 0/ { @sleep[arg0] = sum(arg4); }'
+//
+
+#ifdef LOBERA_USDT
+
+#include <sys/sdt.h>
+#include <exception>
+
+#define LOBERA_TRACE_TRANSFER(probe, req_type, value, index, size, arg)         \
+    DTRACE_PROBE5(lobera, probe, static_cast<unsigned>(req_type),             \
+                                 static_cast<unsigned>(value),                \
+                                 static_cast<unsigned>(index),                \
+                                 static_cast<unsigned long>(size),            \
+                                 static_cast<long>(arg))
+
+namespace lobera_trace
+{
+    // Fires op__start/op__done around a public operation
+    class op_scope
+    {
+    public:
+        explicit op_scope(char const * name)
+            : name_(name)
+            , exceptions_(std::uncaught_exceptions())
+        {
+            DTRACE_PROBE1(lobera, op__start, name_);
+        }
+
+        ~op_scope()
+        {
+            int failed = (std::uncaught_exceptions() > exceptions_) ? 1 : 0;
+            DTRACE_PROBE2(lobera, op__done, name_, failed);
+        }
+
+        op_scope(op_scope const &) = delete;
+        op_scope & operator=(op_scope const &) = delete;
+
+    private:
+        char const * name_;
+        int          exceptions_;
+    };
+}
+
+#define LOBERA_TRACE_OP(name) lobera_trace::op_scope lobera_trace_op_(name)
+
+#else
+
+#define LOBERA_TRACE_TRANSFER(probe, req_type, value, index, size, arg) do {} while (0)
+#define LOBERA_TRACE_OP(name) do {} while (0)
+
+#endif
@@ -1,424 +1,132 @@
 #include "lobera_usb.hpp"
+#include "lobera_arena.hpp"
+#include "lobera_codec.hpp"
+#include "lobera_mirror.hpp"
+#include "lobera_pacing_ledger.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_simd.hpp"
+#include "lobera_trace.hpp"
 
+#include <usb.h>
+
+#include <algorithm>
 #include <cstring>
 #include <chrono>
+#include <mutex>
 
-#define VENDOR_ID        0x195d
-
-#define BATCH_SIZE       4096
-#define OFFSETS_SIZE     575
-#define REPEAT_SIZE      228
-#define THUMB_MAX_MACRO  1024
-
-#define KEY_CODE_DISABLE 0x8c
-
-#define W_FINILIZE       0x14
-#define R_PROFILE        0x15
-#define W_PROFILE        0x14
-#define R_STATUS         0x04
-#define W_LIGHT_MODE     0x31
-#define R_COLORS         0x33
-#define W_COLORS         0x32
-#define R_THUMBS_MACROS  0x51
-#define W_THUMBS_MACROS  0x50
-#define R_THUMB_ENABLED  0x53
-#define W_THUMB_ENABLED  0x52
-#define R_KEYS_OFFSETS   0x11
-#define W_KEYS_OFFSETS   0x10
-#define R_KEYS_DATA      0x13
-#define W_KEYS_DATA      0x12
-#define R_KEYS_REPEATS   0x17
-#define W_KEYS_REPEATS   0x16
+#define RESUME_BACKOFF_MS     250
+#define RESUME_BACKOFF_MAX_MS 4000
 
 namespace
 {
-    struct offset_entry
-    {
-        enum struct type: uint8_t
-        {
-            OF_NONE  = 0x00,
-            OF_SUBST = 0x10,
-            OF_MACRO = 0x20,
-        };
-
-        type     op = type::OF_NONE;
-        uint16_t offset;
-        uint16_t len;
-    };
-
-    struct repeat_entry
-    {
-        uint8_t                 key;
-        lobera_usb::repeat_mode mode;
-    };
-
-    //
-    // Repeats block
-    //
-    size_t decode_repeat_entry(uint8_t const * data, size_t data_size, size_t p, repeat_entry & entry)
+    // Steady clock: deadlines are shared with other processes through the
+    // pacing ledger and must not jump with wall clock changes
+    uint64_t now_ms()
     {
-        if ((data_size - p) < 2)
-            throw std::runtime_error("Broken repeats data");
-
-        uint8_t key = data[p];
-        if (key == 0)
-            return 0;
-
-        lobera_usb::repeat_mode mode = static_cast<lobera_usb::repeat_mode>(data[p + 1]);
-        switch (mode)
-        {
-            case lobera_usb::repeat_mode::SINGLE:
-            case lobera_usb::repeat_mode::PRESS:
-            case lobera_usb::repeat_mode::NEXT:
-                entry.key = data[p];
-                entry.mode = mode;
-                return 2;
-        }
-        throw std::runtime_error(std::string("Unknown macro repeat mode: ") + std::to_string(data[p + 1]));
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch() ).count();
     }
 
-    size_t encode_repeat_entry(std::pair<uint8_t, lobera_usb::key_setting> const & entry,
-                               uint8_t                                           * data,
-                               size_t                                              data_size,
-                               size_t                                              p)
-    {
-        using setting_type = lobera_usb::key_setting::type;
-
-        switch (entry.second.get_type())
-        {
-            case setting_type::DISABLE:
-            case setting_type::SUBST:
-            case setting_type::MACRO:
-                if (data != nullptr)
-                {
-                    if ((data_size - p) < 2)
-                        return 0;
-                    data[p++] = entry.first;
-                    data[p++] = static_cast<uint8_t>(entry.second.get_repeat_mode());
-                }
-                return 2;
-        }
-        throw std::runtime_error("Unknown key setting type: " + std::to_string(static_cast<unsigned>(entry.second.get_type())));
-    }
+    uint8_t const ZERO_BLOCK[BATCH_SIZE] = {0};
 
-    std::vector<repeat_entry> decode_repeat_entries(uint8_t const * data, size_t data_size)
-    {
-        std::vector<repeat_entry> entries;
-        for (size_t p = 0; p < data_size; )
-        {
-            repeat_entry entry;
-            size_t sz = decode_repeat_entry(data, data_size, p, entry);
-            if (sz == 0)
-                break;
-            p += sz;
-            entries.push_back(entry);
-        }
-        return entries;
-    }
-
-    void encode_repeat_entries(lobera_usb::keys_settings const & entries, uint8_t * data, size_t data_size)
-    {
-        size_t p = 0;
-        for (auto const & entry: entries)
-            p += encode_repeat_entry(entry, data, data_size, p);
-        for (; p < data_size - 1; )
-        {
-            data[p++] = 0x00;
-            data[p++] = 0x01;
-        }
-    }
+    uint8_t const DEFAULT_COLORS[18] = {
+        0xff, 0x00, 0xff,
+        0x00, 0x00, 0xff,
+        0xff, 0x00, 0x00,
+        0xff, 0xff, 0xff,
+        0x00, 0xff, 0x00,
+        0xff, 0xff, 0x00
+    };
 
-    //
-    // Macro
-    //
-    size_t decode_macro_entry(uint8_t const * data, size_t data_size, size_t p, lobera_usb::macro_entry & entry)
+    // Calls f for each supported keyboard until it returns true. libusb
+    // keeps the bus list in globals, so enumeration is serialized.
+    void for_each_device(std::function<bool(struct usb_device *)> const & f)
     {
-        using macro_type = lobera_usb::macro_entry::type;
+        static std::mutex lock;
+        std::lock_guard<std::mutex> guard(lock);
 
-        switch (data[p])
-        {
-            case 0x00:
-                return 0;
-
-            case 0x84:
-                if ((data_size - p) < 3)
-                    throw std::runtime_error("Broken macro data");
-                entry = data[p + 2]
-                    ? lobera_usb::macro_entry::key_dn(data[p + 1])
-                    : lobera_usb::macro_entry::key_up(data[p + 1]);
-                return 3;
-
-            case 0x86:
-                if ((data_size - p) < 3)
-                    throw std::runtime_error("Broken macro data");
-                entry = lobera_usb::macro_entry::repeat(data[p + 1] * 0x100 + data[p + 2]);
-                return 3;
-
-            case 0x87:
-                if ((data_size - p) < 3)
-                    throw std::runtime_error("Broken macro data");
-                entry = lobera_usb::macro_entry::sleep(data[p + 1] * 0x100 + data[p + 2]);
-                return 3;
-        }
-        throw std::runtime_error(std::string("Unknown macro code: ") + std::to_string(data[p]));
-    }
+        usb_init();
 
-    size_t encode_macro_entry(lobera_usb::macro_entry const & entry, uint8_t * data, size_t data_size, size_t p)
-    {
-        using macro_type = lobera_usb::macro_entry::type;
+        usb_find_busses();
+        usb_find_devices();
 
-        switch (entry.get_type())
+        for (struct usb_bus *bus = usb_get_busses(); bus; bus = bus->next)
         {
-            case macro_type::KEY_DN:
-            case macro_type::KEY_UP:
-                if (data != nullptr)
-                {
-                    if ((data_size - p) < 3)
-                        throw std::runtime_error("Macro is too large");
-                    data[p++] = 0x84;
-                    data[p++] = entry.get_key_code();
-                    data[p++] = (entry.get_type() == macro_type::KEY_DN) ? 1 : 0;
-                }
-                return 3;
-
-            case macro_type::REPEAT:
-                if (data != nullptr)
-                {
-                    if ((data_size - p) < 3)
-                        throw std::runtime_error("Macro is too large");
-                    data[p++] = 0x86;
-                    data[p++] = entry.get_repeat() >> 8;
-                    data[p++] = entry.get_repeat() & 0xff;
-                }
-                return 3;
-
-            case macro_type::SLEEP:
-                if (data != nullptr)
+            for (struct usb_device *dev = bus->devices; dev; dev = dev->next)
+            {
+                if (dev->descriptor.idVendor == VENDOR_ID)
                 {
-                    if ((data_size - p) < 3)
-                        throw std::runtime_error("Macro is too large");
-                    data[p++] = 0x87;
-                    data[p++] = entry.get_delay() >> 8;
-                    data[p++] = entry.get_delay() & 0xff;
+                    if ((dev->descriptor.idProduct == 0x2033) || (dev->descriptor.idProduct == 0x2034))
+                    {
+                        if (f(dev))
+                            return;
+                    }
                 }
-                return 3;
-        }
-        throw std::runtime_error(std::string("Invalid macro operation: ") + std::to_string(static_cast<unsigned>(entry.get_type())));
-    }
-
-    std::vector<lobera_usb::macro_entry> decode_macro_entries(uint8_t const * data, size_t data_size)
-    {
-        std::vector<lobera_usb::macro_entry> ret;
-        for (size_t p = 0; p < data_size; )
-        {
-            lobera_usb::macro_entry entry;
-            size_t sz = decode_macro_entry(data, data_size, p, entry);
-            if (sz == 0)
-                break;
-            p += sz;
-            ret.push_back(entry);
+            }
         }
-        return ret;
     }
 
-    size_t encode_macro_entries(std::vector<lobera_usb::macro_entry> const & entries, uint8_t * data, size_t data_size)
+    // Part of a dry run image a keys transfer of profile addresses, null for
+    // other transfers
+    std::vector<uint8_t> * image_block(lobera_usb::profile_image & image,
+                                       uint8_t                     profile,
+                                       uint8_t                     req_type,
+                                       uint16_t                    index,
+                                       size_t                    & offset)
     {
-        size_t p = 0;
-        for (auto const & entry: entries)
+        offset = 0;
+        if ((index & 0xff) != profile)
+            return nullptr;
+        switch (req_type)
         {
-            size_t sz = encode_macro_entry(entry, data, data_size, p);
-            if (sz == 0)
-                throw std::runtime_error(std::string("Macro is too large"));
-            p += sz;
+            case R_KEYS_OFFSETS:
+            case W_KEYS_OFFSETS:
+                return &image.offsets;
+            case R_KEYS_REPEATS:
+            case W_KEYS_REPEATS:
+                return &image.repeats;
+            case R_KEYS_DATA:
+            case W_KEYS_DATA:
+                offset = (index >> 8) * BATCH_SIZE;
+                return &image.data;
         }
-        return p;
+        return nullptr;
     }
 
-    //
-    // Keys
-    //
-    lobera_usb::key_setting decode_key_setting(uint8_t                 const * data,
-                                               size_t                          data_size,
-                                               offset_entry            const & offset,
-                                               lobera_usb::repeat_mode         repeat)
+    std::string device_id(struct usb_device * dev)
     {
-        if (offset.op == offset_entry::type::OF_SUBST)
-        {
-            uint8_t key = data[offset.offset];
-            if (key >= KEY_CODE_DISABLE)
-                return lobera_usb::key_setting(repeat);
-            else
-                return lobera_usb::key_setting(key, repeat);
-        } else
-        if (offset.op == offset_entry::type::OF_MACRO)
-        {
-            size_t size = offset.offset + offset.len;
-            if (size > data_size)
-                data_size = size;
-            std::vector<lobera_usb::macro_entry> macro = decode_macro_entries(data + offset.offset, offset.len);
-            return lobera_usb::key_setting(macro, repeat);
-        }
-        throw std::runtime_error("Unknown record type: " + std::to_string(static_cast<unsigned>(offset.op)));
+        return std::string(dev->bus->dirname) + "/" + dev->filename;
     }
 
-    size_t encode_key_setting(lobera_usb::key_setting const & setting, uint8_t * data, size_t data_size, size_t p)
+    std::array<uint32_t, 6> decode_colors(uint8_t const * data)
     {
-        using setting_type = lobera_usb::key_setting::type;
-
-        switch (setting.get_type())
-        {
-            case setting_type::DISABLE:
-                if (data != nullptr)
-                    data[p] = KEY_CODE_DISABLE;
-                return 1;
-
-            case setting_type::SUBST:
-                if (data != nullptr)
-                    data[p] = setting.get_subst_key();
-                return 1;
-
-            case setting_type::MACRO:
-                return encode_macro_entries(setting.get_macro(), data + p, data_size - p);
-        }
-        throw std::runtime_error("Unknown key setting type: " + std::to_string(static_cast<unsigned>(setting.get_type())));
-    }
-
-    lobera_usb::keys_settings decode_keys_settings(std::vector<offset_entry> const & offsets,
-                                                   std::vector<repeat_entry> const & repeats,
-                                                   uint8_t                   const * data,
-                                                   size_t                            data_size)
-    {
-        lobera_usb::keys_settings ret;
-
-        auto ioff = offsets.begin(), eoff = offsets.end();
-        auto irep = repeats.begin(), erep = repeats.end();
-        for (; (ioff != eoff) && (irep != erep); ++ioff, ++irep)
-            ret.emplace(irep->key, decode_key_setting(data, data_size, *ioff, irep->mode));
-
+        std::array<uint32_t, 6> ret;
+        for (size_t i = 0; i < ret.size(); ++i)
+            ret[i] = (data[i * 3] << 16) | (data[i * 3 + 1] << 8) | data[i * 3 + 2];
         return ret;
     }
 
-    size_t encode_keys_settings(lobera_usb::keys_settings const & settings, uint8_t * data, size_t data_size)
-    {
-        size_t p = 0;
-        for (auto const & setting: settings)
-            p += encode_key_setting(setting.second, data, data_size, p);
-        return p;
-    }
-
-    size_t calc_num_batches(size_t data_size)
+    // Snapshots are only built when a mirror is attached
+    template<class F>
+    void publish(lobera_mirror * mirror, F && f)
     {
-        size_t ret = data_size / BATCH_SIZE + (((data_size % BATCH_SIZE) > 0) ? 1 : 0);
-        return (ret > 0) ? ret : 1;
+        if (mirror != nullptr)
+            mirror->update(std::forward<F>(f));
     }
 
-    uint64_t now_ms()
+    lobera_usb::profile_image_view view_of(lobera_usb::profile_image const & image)
     {
-        return std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::high_resolution_clock::now().time_since_epoch() ).count();
-    }
-
-    //
-    // Offsets block
-    //
-    size_t decode_offset_entry(uint8_t const * data, size_t data_size, size_t p, offset_entry & entry)
-    {
-        using of_type = offset_entry::type;
-
-        of_type op = static_cast<of_type>(data[p]);
-        switch (op)
-        {
-            case of_type::OF_NONE:
-                return 0;
-
-            case of_type::OF_SUBST:
-            case of_type::OF_MACRO:
-                if ((data_size - p) < 5)
-                    throw std::runtime_error("Broken offsets data");
-                entry.op     = op;
-                entry.offset = data[p + 1] * 0x100 + data[p + 2];
-                entry.len    = data[p + 3] * 0x100 + data[p + 4];
-                return 5;
-        }
-        throw std::runtime_error(std::string("Unknown offset entry code: ") + std::to_string(data[p]));
-    }
-
-    size_t encode_offset_entry(std::pair<uint8_t, lobera_usb::key_setting> const & entry,
-                               size_t                                            & offset,
-                               uint8_t                                           * data,
-                               size_t                                              data_size,
-                               size_t                                              p)
-    {
-        using setting_type = lobera_usb::key_setting::type;
-        size_t sz = encode_key_setting(entry.second, nullptr, 0, 0);
-        if (sz == 0)
-            return 0;
-
-        uint8_t entry_type;
-        switch (entry.second.get_type())
-        {
-            case setting_type::DISABLE:
-            case setting_type::SUBST:
-                entry_type = 0x10;
-                break;
-            case setting_type::MACRO:
-                entry_type = 0x20;
-                break;
-            default:
-                throw std::runtime_error(std::string("Unknown offset entry code: ") + std::to_string(static_cast<unsigned>(entry.second.get_type())));
-        };
-
-        size_t prev_offset = offset;
-        offset += sz;
-        if (data != nullptr)
-        {
-            if ((data_size - p) < 5)
-                return 0;
-            data[p++] = entry_type;
-            data[p++] = prev_offset >> 8;
-            data[p++] = prev_offset & 0xff;
-            data[p++] = sz >> 8;
-            data[p++] = sz & 0xff;
-        }
-        return 5;
-    }
-
-    std::vector<offset_entry> decode_offset_entries(uint8_t const * data, size_t data_size)
-    {
-        std::vector<offset_entry> entries;
-        for (size_t p = 5; p < data_size; )
-        {
-            offset_entry entry;
-            size_t sz = decode_offset_entry(data, data_size, p, entry);
-            if (sz == 0)
-                break;
-            p += sz;
-            entries.push_back(entry);
-        }
-        return entries;
-    }
-
-    void encode_offset_entries(lobera_usb::keys_settings const & entries, uint8_t * data, size_t data_size)
-    {
-        data[0] = 0x72;
-        data[1] = (data_size >> 8) & 0xff;
-        data[2] = data_size & 0xff;
-
-        size_t offset = 0, p = 5;
-        for (auto const & entry: entries)
-        {
-            size_t sz = encode_offset_entry(entry, offset, data, data_size, p);
-            if (sz == 0)
-                break;
-            p += sz;
-        }
-
-        data[3] = (offset >> 8) & 0xff;
-        data[4] = offset & 0xff;
+        lobera_usb::profile_image_view view;
+        view.offsets   = image.offsets.data();
+        view.data      = image.data.data();
+        view.data_size = image.data.size();
+        view.repeats   = image.repeats.data();
+        return view;
     }
 }
 
 lobera_usb::lobera_usb()
+    : arena_(new lobera_arena())
 {   }
 
 lobera_usb::~lobera_usb()
@@ -428,99 +136,166 @@ lobera_usb::~lobera_usb()
 
 void lobera_usb::open()
 {
-    close();
-
-    usb_init();
+    open(std::string());
+}
 
-    usb_find_busses();
-    usb_find_devices();
+void lobera_usb::open(std::string const & device)
+{
+    LOBERA_TRACE_OP("open");
+    close();
 
-    for (struct usb_bus *bus = usb_get_busses(); bus; bus = bus->next)
-    {
-        for (struct usb_device *dev = bus->devices; dev; dev = dev->next)
-        {
-            if (dev->descriptor.idVendor == VENDOR_ID)
-            {
-                if ((dev->descriptor.idProduct == 0x2033) || (dev->descriptor.idProduct == 0x2034))
-                {
-                    h_ = usb_open(dev);
-                    if (h_ == nullptr)
-                        throw std::runtime_error(std::string("Error opening USB device: ") + usb_strerror());
-                    return;
-                }
-            }
-        }
-    }
+    for_each_device([&](struct usb_device * dev) {
+        if (!device.empty() && (device_id(dev) != device))
+            return false;
+        h_ = usb_open(dev);
+        if (h_ == nullptr)
+            throw std::runtime_error(std::string("Error opening USB device: ") + usb_strerror());
+        device_ = device_id(dev);
+        return true;
+    });
+
+    if (h_ == nullptr)
+        throw std::runtime_error("USB device not found" + (device.empty() ? std::string() : ": " + device));
+}
 
-    throw std::runtime_error("USB device not found");
+std::vector<std::string> lobera_usb::list_devices()
+{
+    std::vector<std::string> devices;
+    for_each_device([&](struct usb_device * dev) {
+        devices.push_back(device_id(dev));
+        return false;
+    });
+    return devices;
 }
 
 void lobera_usb::close()
 {
+    LOBERA_TRACE_OP("close");
     if (h_ != nullptr)
     {
         usb_close(h_);
         h_ = nullptr;
     }
+    device_.clear();
+    ledger_.reset();
+}
+
+void lobera_usb::share_pacing(std::string const & dir)
+{
+    if (h_ == nullptr)
+        throw std::runtime_error("USB device not open");
+    ledger_.reset(new lobera_pacing_ledger(device_, dir));
 }
 
 uint8_t lobera_usb::get_profile()
 {
+    LOBERA_TRACE_OP("get_profile");
     uint8_t mode[1] = {0};
     read_data(R_PROFILE, 0, 0, mode, sizeof(mode));
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.profile = mode[0];
+        s.known |= lobera_mirror::snapshot::PROFILE;
+    });
     return mode[0];
 }
 
 void lobera_usb::set_profile(uint8_t profile)
 {
+    LOBERA_TRACE_OP("set_profile");
     if ((profile < 1) || (profile > 5))
         throw std::runtime_error("Invalid profile number");
     write_data(W_PROFILE, profile, 0, nullptr, 0, 500, 500);
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.profile = profile;
+        s.known |= lobera_mirror::snapshot::PROFILE;
+    });
 }
 
 uint8_t lobera_usb::get_brightness()
 {
+    LOBERA_TRACE_OP("get_brightness");
     uint8_t data[16] = {0};
     read_data(R_STATUS, 0, 0, data, sizeof(data));
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.status.brightness = data[1];
+        s.known |= lobera_mirror::snapshot::BRIGHTNESS;
+    });
     return data[1];
 }
 
 bool lobera_usb::get_full_nkpo()
 {
+    LOBERA_TRACE_OP("get_full_nkpo");
     uint8_t data[16] = {0};
     read_data(R_STATUS, 0, 0, data, sizeof(data));
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.status.full_nkpo = !!data[0];
+        s.known |= lobera_mirror::snapshot::FULL_NKPO;
+    });
     return !!data[0];
 }
 
 lobera_usb::light_mode lobera_usb::get_light_mode()
 {
+    LOBERA_TRACE_OP("get_light_mode");
     uint8_t data[16] = {0};
     read_data(R_STATUS, 0, 0, data, sizeof(data));
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.status.mode = static_cast<light_mode>(data[4]);
+        s.known |= lobera_mirror::snapshot::LIGHT_MODE;
+    });
     return static_cast<light_mode>(data[4]);
 }
 
+lobera_usb::status lobera_usb::get_status()
+{
+    LOBERA_TRACE_OP("get_status");
+    uint8_t data[16] = {0};
+    read_data(R_STATUS, 0, 0, data, sizeof(data));
+    status ret{!!data[0], data[1], static_cast<light_mode>(data[4])};
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.status = ret;
+        s.known |= lobera_mirror::snapshot::BRIGHTNESS | lobera_mirror::snapshot::FULL_NKPO | lobera_mirror::snapshot::LIGHT_MODE;
+    });
+    return ret;
+}
+
 void lobera_usb::set_light_mode(light_mode mode)
 {
+    LOBERA_TRACE_OP("set_light_mode");
+    pacing_hold hold(*this);
     write_data(W_LIGHT_MODE, static_cast<uint16_t>(mode), 0, nullptr, 0, 500, 500);
     write_data(W_FINILIZE, 0, 0);
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.status.mode = mode;
+        s.known |= lobera_mirror::snapshot::LIGHT_MODE;
+    });
 }
 
 uint32_t lobera_usb::get_profile_color(uint8_t profile)
 {
+    LOBERA_TRACE_OP("get_profile_color");
     if (profile > 5)
         throw std::runtime_error("Invalid profile number");
 
     uint8_t data[18] = {0};
     read_data(R_COLORS, 0, 0, data, sizeof(data));
-    return (data[profile * 3] << 16) | (data[profile * 3 + 1] << 8) | data[profile * 3 + 2];
+    std::array<uint32_t, 6> colors = decode_colors(data);
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.colors = colors;
+        s.known |= lobera_mirror::snapshot::COLORS;
+    });
+    return colors[profile];
 }
 
 void lobera_usb::set_profile_color(uint8_t profile, uint32_t rgb)
 {
+    LOBERA_TRACE_OP("set_profile_color");
     if (profile > 5)
         throw std::runtime_error("Invalid profile number");
+    pacing_hold hold(*this);
 
-    char data[18] = {0};
+    uint8_t data[18] = {0};
     read_data(R_COLORS, 0, 0, data, sizeof(data));
     data[profile * 3]     = (rgb >> 16) & 0xFF;
     data[profile * 3 + 1] = (rgb >> 8) & 0xFF;
@@ -528,31 +303,75 @@ void lobera_usb::set_profile_color(uint8_t profile, uint32_t rgb)
 
     write_data(W_COLORS, 0, 0, data, sizeof(data), 500);
     write_data(W_FINILIZE, 0, 0);
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.colors = decode_colors(data);
+        s.known |= lobera_mirror::snapshot::COLORS;
+    });
+}
+
+std::array<uint32_t, 6> lobera_usb::get_profile_colors()
+{
+    LOBERA_TRACE_OP("get_profile_colors");
+    uint8_t data[18] = {0};
+    read_data(R_COLORS, 0, 0, data, sizeof(data));
+
+    std::array<uint32_t, 6> ret = decode_colors(data);
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.colors = ret;
+        s.known |= lobera_mirror::snapshot::COLORS;
+    });
+    return ret;
+}
+
+void lobera_usb::set_profile_colors(std::array<uint32_t, 6> const & rgb)
+{
+    LOBERA_TRACE_OP("set_profile_colors");
+    pacing_hold hold(*this);
+    uint8_t data[18] = {0};
+    for (size_t i = 0; i < rgb.size(); ++i)
+    {
+        data[i * 3]     = (rgb[i] >> 16) & 0xFF;
+        data[i * 3 + 1] = (rgb[i] >> 8) & 0xFF;
+        data[i * 3 + 2] = rgb[i] & 0xFF;
+    }
+
+    write_data(W_COLORS, 0, 0, data, sizeof(data), 500);
+    write_data(W_FINILIZE, 0, 0);
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.colors = rgb;
+        s.known |= lobera_mirror::snapshot::COLORS;
+    });
 }
 
 lobera_usb::macro lobera_usb::get_thumb_macro(uint8_t profile, uint8_t thumb)
 {
+    LOBERA_TRACE_OP("get_thumb_macro");
     if ((profile < 1) || (profile > 5))
         throw std::runtime_error("Invalid profile number");
     if ((thumb < 1) || (thumb > 3))
         throw std::runtime_error("Invalid thumb button number");
+    pacing_hold hold(*this);
 
     char c = 0;
     read_data(R_THUMB_ENABLED, thumb, profile, &c, 1);
     if (c == 0)
         return {};
 
-    uint8_t data[BATCH_SIZE] = {0};
-    read_data(R_THUMBS_MACROS, 0, profile, data, sizeof(data));
-    return decode_macro_entries(data + (thumb - 1) * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+    uint8_t * data = arena_->block;
+    read_data(R_THUMBS_MACROS, 0, profile, data, BATCH_SIZE);
+    return lobera_codec::decode_macro_entries(data + (thumb - 1) * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
 }
 
 void lobera_usb::set_thumb_macro(uint8_t profile, uint8_t thumb, macro const & macro)
 {
+    LOBERA_TRACE_OP("set_thumb_macro");
     if ((profile < 1) || (profile > 5))
         throw std::runtime_error("Invalid profile number");
     if ((thumb < 1) || (thumb > 3))
         throw std::runtime_error("Invalid thumb button number");
+    if (lobera_codec::encode_macro_entries(macro, nullptr, 0) > THUMB_MAX_MACRO)
+        throw std::runtime_error("Macro is too large");
+    pacing_hold hold(*this);
 
     // Check current thumb macros state
     uint8_t macro_set[3] = {0};
@@ -565,8 +384,8 @@ void lobera_usb::set_thumb_macro(uint8_t profile, uint8_t thumb, macro const & m
     }
 
     // Get current thumb macros
-    uint8_t data[BATCH_SIZE] = {0};
-    read_data(R_THUMBS_MACROS, 0, profile, data, sizeof(data));
+    uint8_t * data = arena_->block;
+    read_data(R_THUMBS_MACROS, 0, profile, data, BATCH_SIZE);
 
     // Zero data
     size_t pos = 0;
@@ -575,111 +394,641 @@ void lobera_usb::set_thumb_macro(uint8_t profile, uint8_t thumb, macro const & m
         if ((macro_set[ithumb - 1] == 0) || (ithumb == thumb))
             std::memset(data + pos, 0, THUMB_MAX_MACRO);
     }
-    std::memset(data + pos, 0, sizeof(data) - pos);
+    std::memset(data + pos, 0, BATCH_SIZE - pos);
 
     // Fill macro data
-    encode_macro_entries(macro, data + (thumb - 1) * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+    lobera_codec::encode_macro_entries(macro, data + (thumb - 1) * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
 
     // Apply
-    write_data(W_THUMBS_MACROS, 0, profile, data, sizeof(data), 1500, 1500);
+    write_data(W_THUMBS_MACROS, 0, profile, data, BATCH_SIZE, 1500, 1500);
     for (uint16_t ithumb = 1; ithumb <= 3; ++ithumb)
         write_data(W_THUMB_ENABLED, ithumb | (macro_set[ithumb - 1] ? 0x0100 : 0x0000), profile, nullptr, 0, 500, 500);
 }
 
 lobera_usb::keys_settings lobera_usb::get_profile_buttons(uint8_t profile)
 {
+    LOBERA_TRACE_OP("get_profile_buttons");
+    keys_settings ret;
+    read_profile_buttons(profile, [&](uint8_t key, key_setting && setting) { ret.emplace(key, std::move(setting)); });
+    publish_keys(profile, &ret);
+    return ret;
+}
+
+void lobera_usb::read_profile_buttons(uint8_t profile, key_callback const & cb)
+{
+    LOBERA_TRACE_OP("read_profile_buttons");
     if ((profile < 1) || (profile > 5))
         throw std::runtime_error("Invalid profile number");
+    pacing_hold hold(*this);
 
-    // Load offsets
+    // Tables first, they say which bytes of which batches are needed
     uint8_t offset_table[OFFSETS_SIZE] = {0};
     size_t sz = read_data(R_KEYS_OFFSETS, 0, profile, offset_table, sizeof(offset_table));
     if (sz != sizeof(offset_table))
         throw std::runtime_error("Invalid data retrieved");
-    if ((offset_table[0] != 0x72) && (offset_table[0] != 0x00)) // 114 keys?
+    if ((offset_table[0] != 0x72) && (offset_table[0] != 0x00))
         throw std::runtime_error("Invalid data retrieved");
     size_t recv_size = offset_table[1] * 0x100 + offset_table[2];
     if ((recv_size != sizeof(offset_table)) && (recv_size != 0))
         throw std::runtime_error("Invalid data retrieved");
+    uint8_t repeat_buf[REPEAT_SIZE] = {0};
+    sz = read_data(R_KEYS_REPEATS, 0, profile, repeat_buf, sizeof(repeat_buf));
+    if (sz != sizeof(repeat_buf))
+        throw std::runtime_error("Invalid data retrieved");
 
-    std::vector<offset_entry> offsets = decode_offset_entries(offset_table, sizeof(offset_table));
+    lobera_codec::try_decode_offset_entries(offset_table, sizeof(offset_table), arena_->offsets).value();
+    lobera_codec::try_decode_repeat_entries(repeat_buf, sizeof(repeat_buf), arena_->repeats).value();
     size_t data_size = offset_table[3] * 0x100 + offset_table[4];
-    size_t num_batches = calc_num_batches(data_size);
+    size_t num_batches = lobera_codec::calc_num_batches(data_size);
+
+    lobera_codec::keys_stream_decoder decoder;
+    decoder.reset(arena_->offsets, arena_->repeats, num_batches * BATCH_SIZE).value();
+
+    // Each batch is decoded while the device cools down before the next read
+    for (size_t need = decoder.next_needed(); need != SIZE_MAX; need = decoder.next_needed())
+    {
+        size_t batch_num = need / BATCH_SIZE;
+        uint16_t index = (batch_num << 8) | profile;
+        sz = read_data(R_KEYS_DATA, 0, index, arena_->block, BATCH_SIZE);
+        if (sz != BATCH_SIZE)
+            throw std::runtime_error("Invalid data retrieved");
+        decoder.feed(batch_num * BATCH_SIZE, arena_->block, BATCH_SIZE, cb).value();
+    }
+}
+
+void lobera_usb::set_profile_buttons(uint8_t profile, keys_settings const & settings)
+{
+    LOBERA_TRACE_OP("set_profile_buttons");
+    if ((profile < 1) || (profile > 5))
+        throw std::runtime_error("Invalid profile number");
+
+    lobera_codec::keys_stream_encoder encoder(settings);
+    uint8_t offset_table[OFFSETS_SIZE] = {0};
+    lobera_codec::encode_offset_entries(settings, offset_table, sizeof(offset_table));
+    uint8_t repeat_buf[REPEAT_SIZE] = {0};
+    lobera_codec::encode_repeat_entries(settings, repeat_buf, sizeof(repeat_buf));
+
+    // Written directly rather than queued, each batch is encoded while the
+    // previous write cools down. On failure the failed and remaining writes
+    // become the checkpoint for resume(), as write_profile_image() leaves it.
+    uint8_t * batch = arena_->block;
+    size_t num_batches = encoder.num_batches(), step = 0;
+    pacing_hold hold(*this);
+    discard_checkpoint();
+    try
+    {
+        write_data(W_KEYS_OFFSETS, 0, profile, offset_table, sizeof(offset_table), 500, 500);
+        for (++step; encoder.next_batch(batch); ++step)
+            write_data(W_KEYS_DATA, 0, ((step - 1) << 8) | profile, batch, BATCH_SIZE, 4000, 4000);
+        write_data(W_KEYS_REPEATS, 0, profile, repeat_buf, sizeof(repeat_buf), 1000, 1000);
+        ++step;
+        write_data(W_FINILIZE, 0, 0, nullptr, 0, 0, 0);
+    }
+    catch (...)
+    {
+        if (step == 0)
+            checkpoint_.push(W_KEYS_OFFSETS, 0, profile, offset_table, sizeof(offset_table), 500, 500);
+        if (step <= num_batches)
+        {
+            if (step > 0)
+                checkpoint_.push(W_KEYS_DATA, 0, ((step - 1) << 8) | profile, batch, BATCH_SIZE, 4000, 4000);
+            for (size_t batch_num = step; encoder.next_batch(batch); ++batch_num)
+                checkpoint_.push(W_KEYS_DATA, 0, (batch_num << 8) | profile, batch, BATCH_SIZE, 4000, 4000);
+        }
+        if (step <= num_batches + 1)
+            checkpoint_.push(W_KEYS_REPEATS, 0, profile, repeat_buf, sizeof(repeat_buf), 1000, 1000);
+        checkpoint_.push(W_FINILIZE, 0, 0, nullptr, 0, 0, 0);
+        publish_keys(profile, nullptr);
+        throw;
+    }
+    publish_keys(profile, &settings);
+}
+
+lobera_usb::profile_image lobera_usb::read_profile_image(uint8_t profile)
+{
+    LOBERA_TRACE_OP("read_profile_image");
+    profile_image image;
+    read_profile_image(profile, image);
+    return image;
+}
+
+void lobera_usb::read_profile_image(uint8_t profile, profile_image & image)
+{
+    if ((profile < 1) || (profile > 5))
+        throw std::runtime_error("Invalid profile number");
+    pacing_hold hold(*this);
+
+    // Load offsets
+    image.offsets.assign(OFFSETS_SIZE, 0);
+    size_t sz = read_data(R_KEYS_OFFSETS, 0, profile, image.offsets.data(), image.offsets.size());
+    if (sz != image.offsets.size())
+        throw std::runtime_error("Invalid data retrieved");
+    if ((image.offsets[0] != 0x72) && (image.offsets[0] != 0x00)) // 114 keys?
+        throw std::runtime_error("Invalid data retrieved");
+    size_t recv_size = image.offsets[1] * 0x100 + image.offsets[2];
+    if ((recv_size != image.offsets.size()) && (recv_size != 0))
+        throw std::runtime_error("Invalid data retrieved");
+
+    size_t data_size = image.offsets[3] * 0x100 + image.offsets[4];
+    size_t num_batches = lobera_codec::calc_num_batches(data_size);
 
     // Load data batches
-    std::vector<uint8_t> data(num_batches * BATCH_SIZE, 0);
+    image.data.assign(num_batches * BATCH_SIZE, 0);
     for (size_t batch_num = 0; batch_num < num_batches; ++batch_num)
     {
         uint16_t index = (batch_num << 8) | profile;
-        sz = read_data(R_KEYS_DATA, 0, index, data.data() + batch_num * BATCH_SIZE, BATCH_SIZE);
+        sz = read_data(R_KEYS_DATA, 0, index, image.data.data() + batch_num * BATCH_SIZE, BATCH_SIZE);
         if (sz != BATCH_SIZE)
             throw std::runtime_error("Invalid data retrieved");
     }
 
     // Load repeat mode
-    uint8_t repeat_buf[REPEAT_SIZE] = {0};
-    sz = read_data(R_KEYS_REPEATS, 0, profile, repeat_buf, sizeof(repeat_buf));
-    if (sz != sizeof(repeat_buf))
-        throw std::runtime_error("Invalid data retrieved");
-    std::vector<repeat_entry> repeats = decode_repeat_entries(repeat_buf, sizeof(repeat_buf));
-    if (repeats.size() != offsets.size())
+    image.repeats.assign(REPEAT_SIZE, 0);
+    sz = read_data(R_KEYS_REPEATS, 0, profile, image.repeats.data(), image.repeats.size());
+    if (sz != image.repeats.size())
         throw std::runtime_error("Invalid data retrieved");
+}
 
-    return decode_keys_settings(offsets, repeats, data.data(), data.size());
+void lobera_usb::write_profile_image(uint8_t profile, profile_image const & image)
+{
+    if ((image.offsets.size() != OFFSETS_SIZE) || (image.repeats.size() != REPEAT_SIZE))
+        throw std::runtime_error("Invalid profile image");
+    write_profile_image(profile, view_of(image));
 }
 
-void lobera_usb::set_profile_buttons(uint8_t profile, keys_settings const & settings)
+void lobera_usb::write_profile_image(uint8_t profile, profile_image_view const & image)
 {
+    LOBERA_TRACE_OP("write_profile_image");
     if ((profile < 1) || (profile > 5))
         throw std::runtime_error("Invalid profile number");
+    if ((image.data_size == 0) || ((image.data_size % BATCH_SIZE) != 0))
+        throw std::runtime_error("Invalid profile image");
 
-    size_t num_batches = calc_num_batches(encode_keys_settings(settings, nullptr, 0));
-    std::vector<uint8_t> data(num_batches * BATCH_SIZE, 0);
-    encode_keys_settings(settings, data.data(), data.size());
+    // Not decoded back, the keys are unknown until read
+    publish_keys(profile, nullptr);
+    queue_profile_image(begin_writes(), profile, image);
+    run_writes();
+}
 
-    uint8_t offset_table[OFFSETS_SIZE] = {0};
-    encode_offset_entries(settings, offset_table, sizeof(offset_table));
+void lobera_usb::queue_profile_image(write_queue & writes, uint8_t profile, profile_image_view const & image)
+{
+    size_t num_batches = image.data_size / BATCH_SIZE;
 
+    writes.push(W_KEYS_OFFSETS, 0, profile, image.offsets, OFFSETS_SIZE, 500, 500);
+    for (size_t batch_num = 0; batch_num < num_batches; ++batch_num)
+    {
+        uint16_t index = (batch_num << 8) | profile;
+        writes.push(W_KEYS_DATA, 0, index, image.data + batch_num * BATCH_SIZE, BATCH_SIZE, 4000, 4000);
+    }
+    writes.push(W_KEYS_REPEATS, 0, profile, image.repeats, REPEAT_SIZE, 1000, 1000);
+    writes.push(W_FINILIZE, 0, 0, nullptr, 0, 0, 0);
+
+    if (image.thumbs != nullptr)
+    {
+        writes.push(W_THUMBS_MACROS, 0, profile, image.thumbs, BATCH_SIZE, 1500, 1500);
+        for (uint16_t ithumb = 1; ithumb <= 3; ++ithumb)
+            writes.push(W_THUMB_ENABLED, ithumb | (image.thumb_enabled[ithumb - 1] ? 0x0100 : 0x0000), profile, nullptr, 0, 500, 500);
+    }
+}
+
+void lobera_usb::set_key(uint8_t profile, uint8_t key, key_setting const & setting)
+{
+    LOBERA_TRACE_OP("set_key");
+    using lobera_codec::offset_entry;
+    using lobera_codec::repeat_entry;
+
+    if ((profile < 1) || (profile > 5))
+        throw std::runtime_error("Invalid profile number");
+    pacing_hold hold(*this);
+
+    // Encode key data
+    size_t len = lobera_codec::encode_key_setting(setting, nullptr, 0, 0);
+    if (len == 0)
+        throw std::runtime_error("Empty macro");
+    std::vector<uint8_t> & key_data = arena_->key_data;
+    key_data.assign(len, 0);
+    lobera_codec::encode_key_setting(setting, key_data.data(), key_data.size(), 0);
+
+    // Load tables
+    uint8_t offset_table[OFFSETS_SIZE] = {0};
+    size_t sz = read_data(R_KEYS_OFFSETS, 0, profile, offset_table, sizeof(offset_table));
+    if (sz != sizeof(offset_table))
+        throw std::runtime_error("Invalid data retrieved");
     uint8_t repeat_buf[REPEAT_SIZE] = {0};
-    encode_repeat_entries(settings, repeat_buf, sizeof(repeat_buf));
+    sz = read_data(R_KEYS_REPEATS, 0, profile, repeat_buf, sizeof(repeat_buf));
+    if (sz != sizeof(repeat_buf))
+        throw std::runtime_error("Invalid data retrieved");
+    uint8_t old_offset_table[OFFSETS_SIZE];
+    std::memcpy(old_offset_table, offset_table, sizeof(offset_table));
 
-    write_data(W_KEYS_OFFSETS, 0, profile, offset_table, sizeof(offset_table), 500, 500);
-    for (size_t batch_num = 0; batch_num < num_batches; ++batch_num)
+    std::vector<offset_entry> & offsets = arena_->offsets;
+    std::vector<repeat_entry> & repeats = arena_->repeats;
+    lobera_codec::try_decode_offset_entries(offset_table, sizeof(offset_table), offsets).value();
+    lobera_codec::try_decode_repeat_entries(repeat_buf, sizeof(repeat_buf), repeats).value();
+    if (repeats.size() != offsets.size())
+        throw std::runtime_error("Invalid data retrieved");
+    size_t data_size = (offset_table[0] == 0x72) ? offset_table[3] * 0x100 + offset_table[4] : 0;
+
+    // Find key, new keys are inserted in key order as set_profile_buttons() does
+    auto irep = std::find_if(repeats.begin(), repeats.end(), [key](repeat_entry const & r) { return r.key >= key; });
+    size_t i = irep - repeats.begin();
+    bool found = (irep != repeats.end()) && (irep->key == key);
+    if (!found)
     {
+        if (offsets.size() >= MAX_KEYS)
+            throw std::runtime_error("Too many keys");
+        repeats.insert(irep, repeat_entry{key, setting.get_repeat_mode()});
+        offsets.insert(offsets.begin() + i, offset_entry{});
+    }
+
+    // Reuse old place if new data fits, otherwise append to the tail
+    size_t pos = (found && (len <= offsets[i].len)) ? offsets[i].offset : data_size;
+    size_t new_data_size = std::max(data_size, pos + len);
+
+    size_t live = len;
+    for (size_t j = 0; j < offsets.size(); ++j)
+    {
+        if (j != i)
+            live += offsets[j].len;
+    }
+    if ((new_data_size > MAX_DATA_SIZE) || ((new_data_size - live) > compaction_threshold_ * new_data_size))
+    {
+        keys_settings settings = get_profile_buttons(profile);
+        settings.erase(key);
+        settings.emplace(key, setting);
+        set_profile_buttons(profile, settings);
+        return;
+    }
+
+    bool repeat_changed = !found || (repeats[i].mode != setting.get_repeat_mode());
+    repeats[i].mode   = setting.get_repeat_mode();
+    offsets[i].op     = (setting.get_type() == key_setting::type::MACRO) ? offset_entry::type::OF_MACRO : offset_entry::type::OF_SUBST;
+    offsets[i].offset = pos;
+    offsets[i].len    = len;
+
+    // Patch touched batches
+    size_t first_batch = pos / BATCH_SIZE;
+    size_t last_batch  = (pos + len - 1) / BATCH_SIZE;
+    std::vector<uint8_t> & data = arena_->patch;
+    data.assign((last_batch - first_batch + 1) * BATCH_SIZE, 0);
+    for (size_t batch_num = first_batch; batch_num <= last_batch; ++batch_num)
+    {
+        if (batch_num * BATCH_SIZE >= data_size)
+            break;
         uint16_t index = (batch_num << 8) | profile;
-        write_data(W_KEYS_DATA, 0, index, data.data() + batch_num * BATCH_SIZE, BATCH_SIZE, 4000, 4000);
+        sz = read_data(R_KEYS_DATA, 0, index, data.data() + (batch_num - first_batch) * BATCH_SIZE, BATCH_SIZE);
+        if (sz != BATCH_SIZE)
+            throw std::runtime_error("Invalid data retrieved");
     }
+    // Setting the same data in place doesn't touch the batches
+    uint8_t * dst = data.data() + pos - first_batch * BATCH_SIZE;
+    bool data_changed = (pos >= data_size) || !lobera_simd::equal(dst, key_data.data(), len);
+    std::memcpy(dst, key_data.data(), len);
 
-    write_data(W_KEYS_REPEATS, 0, profile, repeat_buf, sizeof(repeat_buf), 1000, 1000);
-    write_data(W_FINILIZE, 0, 0);
+    lobera_codec::encode_offset_table(offsets, new_data_size, offset_table, sizeof(offset_table));
+    lobera_codec::encode_repeat_table(repeats, repeat_buf, sizeof(repeat_buf));
+    bool offsets_changed = !lobera_simd::equal(old_offset_table, offset_table, sizeof(offset_table));
+    if (!offsets_changed && !data_changed && !repeat_changed)
+        return;
+
+    // Apply
+    write_queue & writes = begin_writes();
+    if (offsets_changed)
+        writes.push(W_KEYS_OFFSETS, 0, profile, offset_table, sizeof(offset_table), 500, 500);
+    for (size_t batch_num = first_batch; (batch_num <= last_batch) && data_changed; ++batch_num)
+    {
+        uint16_t index = (batch_num << 8) | profile;
+        writes.push(W_KEYS_DATA, 0, index, data.data() + (batch_num - first_batch) * BATCH_SIZE, BATCH_SIZE, 4000, 4000);
+    }
+    if (repeat_changed)
+        writes.push(W_KEYS_REPEATS, 0, profile, repeat_buf, sizeof(repeat_buf), 1000, 1000);
+    writes.push(W_FINILIZE, 0, 0, nullptr, 0, 0, 0);
+    try
+    {
+        run_writes();
+    }
+    catch (...)
+    {
+        publish_keys(profile, nullptr);
+        throw;
+    }
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        auto & keys = s.keys[profile - 1];
+        if (keys == nullptr)
+            return false;
+        auto patched = std::make_shared<keys_settings>(*keys);
+        patched->erase(key);
+        patched->emplace(key, setting);
+        keys = std::move(patched);
+        return true;
+    });
 }
 
-void lobera_usb::reset_config()
+void lobera_usb::compact_profile(uint8_t profile)
 {
-    set_light_mode(light_mode::SINGLE);
+    LOBERA_TRACE_OP("compact_profile");
+    pacing_hold hold(*this);
+    set_profile_buttons(profile, get_profile_buttons(profile));
+}
 
-    uint8_t default_colors[] = {
-        0xff, 0x00, 0xff,
-        0x00, 0x00, 0xff,
-        0xff, 0x00, 0x00,
-        0xff, 0xff, 0xff,
-        0x00, 0xff, 0x00,
-        0xff, 0xff, 0x00
-    };
-    write_data(W_COLORS, 0, 0, default_colors, sizeof(default_colors), 500);
-    write_data(W_FINILIZE, 0, 0, nullptr, 0);
+double lobera_usb::get_compaction_threshold() const
+{
+    return compaction_threshold_;
+}
+
+void lobera_usb::set_compaction_threshold(double dead_ratio)
+{
+    if ((dead_ratio < 0.0) || (dead_ratio > 1.0))
+        throw std::runtime_error("Invalid compaction threshold");
+    compaction_threshold_ = dead_ratio;
+}
+
+void lobera_usb::reset_config(bool force)
+{
+    LOBERA_TRACE_OP("reset_config");
+    pacing_hold hold(*this);
+    // Cheap reads first, then one resumable batch of writes for what
+    // differs from defaults
+    write_queue & writes = begin_writes();
+
+    if (force || (get_light_mode() != light_mode::SINGLE))
+    {
+        writes.push(W_LIGHT_MODE, static_cast<uint16_t>(light_mode::SINGLE), 0, nullptr, 0, 500, 500);
+        writes.push(W_FINILIZE, 0, 0, nullptr, 0, 0, 0);
+    }
+
+    uint8_t colors[sizeof(DEFAULT_COLORS)] = {0};
+    if (!force)
+        read_data(R_COLORS, 0, 0, colors, sizeof(colors));
+    if (force || !lobera_simd::equal(colors, DEFAULT_COLORS, sizeof(colors)))
+    {
+        writes.push(W_COLORS, 0, 0, DEFAULT_COLORS, sizeof(DEFAULT_COLORS), 500, 0);
+        writes.push(W_FINILIZE, 0, 0, nullptr, 0, 0, 0);
+    }
 
     for (uint8_t iprofile = 1; iprofile <= 5; ++iprofile)
     {
-        uint8_t data[BATCH_SIZE] = {0};
-        write_data(W_THUMBS_MACROS, 0, iprofile, data, sizeof(data), 2000);
+        uint8_t enabled[3] = {0};
+        bool clean = false;
+        if (!force)
+        {
+            for (uint16_t ithumb = 1; ithumb <= 3; ++ithumb)
+                read_data(R_THUMB_ENABLED, ithumb, iprofile, enabled + ithumb - 1, 1);
+            // set_thumb_macro() zeroes the macros of disabled thumbs, so the
+            // flags tell whether the block holds anything without reading it
+            clean = !(enabled[0] || enabled[1] || enabled[2]);
+        }
+
+        if (!clean)
+            writes.push(W_THUMBS_MACROS, 0, iprofile, ZERO_BLOCK, BATCH_SIZE, 2000, 0);
         for (uint16_t ithumb = 1; ithumb <= 3; ++ithumb)
-            write_data(W_THUMB_ENABLED, ithumb, iprofile, nullptr, 0, 2000);
+        {
+            if (force || enabled[ithumb - 1])
+                writes.push(W_THUMB_ENABLED, ithumb, iprofile, nullptr, 0, 2000, 0);
+        }
     }
 
+    // Keys data isn't compared: the default offsets table references none of it
+    profile_image & empty = arena_->image;
+    compile_profile_image(keys_settings{}, empty);
     for (uint8_t iprofile = 1; iprofile <= 5; ++iprofile)
-        set_profile_buttons(iprofile, keys_settings{});
-};
+    {
+        if (!force)
+        {
+            uint8_t offset_table[OFFSETS_SIZE] = {0};
+            uint8_t repeat_buf[REPEAT_SIZE] = {0};
+            read_data(R_KEYS_OFFSETS, 0, iprofile, offset_table, sizeof(offset_table));
+            read_data(R_KEYS_REPEATS, 0, iprofile, repeat_buf, sizeof(repeat_buf));
+            if (lobera_simd::equal(empty.offsets.data(), offset_table, sizeof(offset_table))
+                && lobera_simd::equal(empty.repeats.data(), repeat_buf, sizeof(repeat_buf)))
+                continue;
+        }
+        queue_profile_image(writes, iprofile, view_of(empty));
+    }
+
+    try
+    {
+        run_writes();
+    }
+    catch (...)
+    {
+        publish(mirror_, [&](lobera_mirror::snapshot & s) {
+            s.known &= ~(lobera_mirror::snapshot::LIGHT_MODE | lobera_mirror::snapshot::COLORS);
+            for (auto & k: s.keys)
+                k.reset();
+        });
+        throw;
+    }
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.status.mode = light_mode::SINGLE;
+        s.colors      = decode_colors(DEFAULT_COLORS);
+        s.known      |= lobera_mirror::snapshot::LIGHT_MODE | lobera_mirror::snapshot::COLORS;
+        auto none = std::make_shared<keys_settings const>();
+        for (auto & k: s.keys)
+            k = none;
+    });
+}
+
+size_t lobera_usb::pending_transfers() const
+{
+    return checkpoint_.size() - checkpoint_done_;
+}
+
+void lobera_usb::resume(size_t max_attempts)
+{
+    LOBERA_TRACE_OP("resume");
+    uint64_t backoff = RESUME_BACKOFF_MS;
+    for (size_t attempt = 1; pending_transfers() > 0; ++attempt)
+    {
+        try
+        {
+            run_checkpoint();
+        }
+        catch (std::exception const &)
+        {
+            if (attempt >= max_attempts)
+                throw;
+            sleep_ms(backoff);
+            backoff = std::min<uint64_t>(backoff * 2, RESUME_BACKOFF_MAX_MS);
+        }
+    }
+}
+
+void lobera_usb::attach_mirror(lobera_mirror * mirror)
+{
+    mirror_ = mirror;
+}
+
+void lobera_usb::publish_keys(uint8_t profile, keys_settings const * keys)
+{
+    publish(mirror_, [&](lobera_mirror::snapshot & s) {
+        s.keys[profile - 1] = (keys != nullptr) ? std::make_shared<keys_settings const>(*keys) : nullptr;
+    });
+}
+
+void lobera_usb::discard_checkpoint()
+{
+    checkpoint_.clear();
+    checkpoint_done_ = 0;
+}
+
+lobera_usb::write_queue & lobera_usb::begin_writes()
+{
+    staging_.clear();
+    return staging_;
+}
+
+void lobera_usb::run_writes()
+{
+    // The old checkpoint's buffers are reused by the next begin_writes()
+    checkpoint_.swap(staging_);
+    checkpoint_done_ = 0;
+    run_checkpoint();
+}
+
+void lobera_usb::run_checkpoint()
+{
+    pacing_hold hold(*this);
+    for (; checkpoint_done_ < checkpoint_.size(); ++checkpoint_done_)
+    {
+        queued_write const & w = checkpoint_[checkpoint_done_];
+        write_data(w.req_type, w.value, w.index, w.data.empty() ? nullptr : w.data.data(), w.data.size(), w.next_write_ms, w.next_read_ms);
+    }
+    discard_checkpoint();
+}
+
+lobera_usb::plan lobera_usb::dry_run(std::function<void(lobera_usb &)> const & op)
+{
+    plan ret;
+    lobera_usb l;
+    l.dry_run_ = &ret;
+    op(l);
+    ret.settle_ms = std::max(ret.duration_ms, std::max(l.next_read_, l.next_write_));
+    return ret;
+}
+
+lobera_usb::plan lobera_usb::dry_run(std::function<void(lobera_usb &)> const & op, uint8_t profile, profile_image & image)
+{
+    plan ret;
+    lobera_usb l;
+    l.dry_run_     = &ret;
+    l.dry_profile_ = profile;
+    l.dry_image_   = &image;
+    op(l);
+    ret.settle_ms = std::max(ret.duration_ms, std::max(l.next_read_, l.next_write_));
+    return ret;
+}
+
+lobera_usb::plan lobera_usb::plan_profile_buttons(uint8_t profile, keys_settings const & settings)
+{
+    return dry_run([&](lobera_usb & l) { l.set_profile_buttons(profile, settings); });
+}
+
+lobera_usb::plan lobera_usb::plan_profile_image(uint8_t profile, profile_image const & image)
+{
+    return dry_run([&](lobera_usb & l) { l.write_profile_image(profile, image); });
+}
+
+lobera_usb::plan lobera_usb::plan_thumb_macro(uint8_t profile, uint8_t thumb, macro const & macro)
+{
+    return dry_run([&](lobera_usb & l) { l.set_thumb_macro(profile, thumb, macro); });
+}
+
+lobera_usb::plan lobera_usb::plan_profile_color(uint8_t profile, uint32_t rgb)
+{
+    return dry_run([&](lobera_usb & l) { l.set_profile_color(profile, rgb); });
+}
+
+lobera_usb::plan lobera_usb::plan_reset_config()
+{
+    return dry_run([](lobera_usb & l) { l.reset_config(true); });
+}
+
+lobera_usb::pacing_hold::pacing_hold(lobera_usb & l) noexcept
+    : l_(l)
+{
+    if (l_.ledger_)
+        l_.ledger_->acquire(l_.clock_ms(), l_.next_read_, l_.next_write_);
+}
+
+lobera_usb::pacing_hold::~pacing_hold()
+{
+    if (l_.ledger_)
+        l_.ledger_->release(l_.next_read_, l_.next_write_);
+}
+
+int lobera_usb::control_msg(int         request_type,
+                            uint8_t     req_type,
+                            uint16_t    value,
+                            uint16_t    index,
+                            void      * data,
+                            size_t      size)
+{
+    return usb_control_msg(h_, request_type, req_type, value, index, static_cast<char *>(data), size, 5000);
+}
+
+uint64_t lobera_usb::clock_ms()
+{
+    return (dry_run_ != nullptr) ? dry_clock_ : now_ms();
+}
+
+void lobera_usb::sleep_ms(uint64_t ms)
+{
+    if (dry_run_ != nullptr)
+        dry_clock_ += ms;
+    else
+        usleep(ms * 1000ull);
+}
+
+lobera_result<size_t> lobera_usb::try_read_data(uint8_t    req_type,
+                                                uint16_t   value,
+                                                uint16_t   index,
+                                                void     * data,
+                                                size_t     size,
+                                                uint64_t   next_write_ms,
+                                                uint64_t   next_read_ms) noexcept
+{
+    pacing_hold hold(*this);
+    auto     now   = clock_ms();
+    uint64_t slept = 0;
+    if (now < next_read_)
+    {
+        slept = next_read_ - now;
+        sleep_ms(slept);
+        now = next_read_;
+    }
+    LOBERA_TRACE_TRANSFER(read__start, req_type, value, index, size, slept);
+    next_read_  = std::max(next_read_,  now + next_read_ms);
+    next_write_ = std::max(next_write_, now + next_write_ms);
+
+    if (dry_run_ != nullptr)
+    {
+        try
+        {
+            dry_run_->transfers.push_back(transfer{false, req_type, value, index, size, now, next_write_ms, next_read_ms});
+        }
+        catch (std::bad_alloc const &)
+        {
+            return lobera_result<size_t>(lobera_errc::OUT_OF_MEMORY);
+        }
+        dry_run_->bytes_read += size;
+        std::memset(data, 0, size);
+        size_t offset = 0;
+        std::vector<uint8_t> * block = (dry_image_ != nullptr) ? image_block(*dry_image_, dry_profile_, req_type, index, offset) : nullptr;
+        if ((block != nullptr) && (offset < block->size()))
+            std::memcpy(data, block->data() + offset, std::min(size, block->size() - offset));
+        dry_clock_ = now + EST_TRANSFER_MS(size);
+        dry_run_->duration_ms = dry_clock_;
+        LOBERA_TRACE_TRANSFER(read__done, req_type, value, index, size, size);
+        return size;
+    }
+
+    int ret = control_msg(0xc0, req_type, value, index, data, size);
+    LOBERA_TRACE_TRANSFER(read__done, req_type, value, index, size, ret);
+    if (ret < 0)
+        return lobera_result<size_t>(lobera_errc::READ_FAILED, ret);
+    return static_cast<size_t>(ret);
+}
 
 size_t lobera_usb::read_data(uint8_t    req_type,
                              uint16_t   value,
@@ -689,19 +1038,65 @@ size_t lobera_usb::read_data(uint8_t    req_type,
                              uint64_t   next_write_ms,
                              uint64_t   next_read_ms)
 {
-    auto now = now_ms();
-    if (now < next_read_)
+    auto ret = try_read_data(req_type, value, index, data, size, next_write_ms, next_read_ms);
+    if (!ret)
+        throw std::runtime_error(lobera_error_message(ret.error()) + " (" + usb_strerror() + ")");
+    return *ret;
+}
+
+lobera_result<void> lobera_usb::try_write_data(uint8_t          req_type,
+                                               uint16_t         value,
+                                               uint16_t         index,
+                                               void     const * data,
+                                               size_t           size,
+                                               uint64_t         next_write_ms,
+                                               uint64_t         next_read_ms) noexcept
+{
+    pacing_hold hold(*this);
+    auto     now   = clock_ms();
+    uint64_t slept = 0;
+    if (now < next_write_)
     {
-        usleep((next_read_ - now) * 1000ull);
-        now = next_read_;
+        slept = next_write_ - now;
+        sleep_ms(slept);
+        now = next_write_;
     }
+    LOBERA_TRACE_TRANSFER(write__start, req_type, value, index, size, slept);
     next_read_  = std::max(next_read_,  now + next_read_ms);
     next_write_ = std::max(next_write_, now + next_write_ms);
 
-    int ret = usb_control_msg(h_, 0xc0, req_type, value, index, static_cast<char *>(data), size, 5000);
+    if (dry_run_ != nullptr)
+    {
+        try
+        {
+            dry_run_->transfers.push_back(transfer{true, req_type, value, index, size, now, next_write_ms, next_read_ms});
+            size_t offset = 0;
+            std::vector<uint8_t> * block = (dry_image_ != nullptr) ? image_block(*dry_image_, dry_profile_, req_type, index, offset) : nullptr;
+            if (block != nullptr)
+            {
+                if (block->size() < offset + size)
+                    block->resize(offset + size, 0);
+                std::memcpy(block->data() + offset, data, size);
+            }
+        }
+        catch (std::bad_alloc const &)
+        {
+            return lobera_result<void>(lobera_errc::OUT_OF_MEMORY);
+        }
+        dry_run_->bytes_written += size;
+        if (req_type == W_KEYS_DATA)
+            ++dry_run_->batches;
+        dry_clock_ = now + EST_TRANSFER_MS(size);
+        dry_run_->duration_ms = dry_clock_;
+        LOBERA_TRACE_TRANSFER(write__done, req_type, value, index, size, size);
+        return {};
+    }
+
+    auto ret = control_msg(0x40, req_type, value, index, const_cast<void *>(data), size);
+    LOBERA_TRACE_TRANSFER(write__done, req_type, value, index, size, ret);
     if (ret < 0)
-        throw std::runtime_error(std::string("Error reading data: ") + std::to_string(ret) + " (" + usb_strerror() + ")");
-    return ret;
+        return lobera_result<void>(lobera_errc::WRITE_FAILED, ret);
+    return {};
 }
 
 void lobera_usb::write_data(uint8_t          req_type,
@@ -712,16 +1107,7 @@ void lobera_usb::write_data(uint8_t          req_type,
                             uint64_t         next_write_ms,
                             uint64_t         next_read_ms)
 {
-    auto now = now_ms();
-    if (now < next_write_)
-    {
-        usleep((next_write_ - now) * 1000ull);
-        now = next_write_;
-    }
-    next_read_  = std::max(next_read_,  now + next_read_ms);
-    next_write_ = std::max(next_write_, now + next_write_ms);
-
-    auto ret = usb_control_msg(h_, 0x40, req_type, value, index, static_cast<char *>(const_cast<void *>(data)), size, 5000);
-    if (ret < 0)
-        throw std::runtime_error(std::string("Error writing data: ") + std::to_string(ret) + " (" + usb_strerror() + ")");
+    auto ret = try_write_data(req_type, value, index, data, size, next_write_ms, next_read_ms);
+    if (!ret)
+        throw std::runtime_error(lobera_error_message(ret.error()) + " (" + usb_strerror() + ")");
 }
@@ -1,10 +1,26 @@
-#include <usb.h>
+#pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include <array>
+#include <functional>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include <iostream>
 
+#include "lobera_result.hpp"
+
+struct usb_dev_handle;
+struct lobera_arena;
+class lobera_mirror;
+class lobera_pacing_ledger;
+
 class lobera_usb
 {
 public:
@@ -23,6 +39,7 @@ public:
         NEXT   = 3,
     };
 
+    // Packed to the 3 bytes of its wire form
     class macro_entry
     {
     public:
@@ -36,77 +53,88 @@ public:
         };
 
     private:
-        macro_entry(type t, uint8_t key, uint16_t repeat, uint8_t delay)
+        macro_entry(type t, uint16_t value)
             : type_(t)
-            , key_code_(key)
-            , repeat_(repeat)
-            , delay_ms_(delay)
+            , hi_(value >> 8)
+            , lo_(value & 0xff)
         {   }
 
     public:
         macro_entry()
             : type_(type::NONE)
-            , key_code_(0)
-            , repeat_(0)
-            , delay_ms_(0)
+            , hi_(0)
+            , lo_(0)
         {   }
 
         static macro_entry key_dn(uint8_t key)
-        {   return macro_entry(type::KEY_DN, key, 0, 0);   }
+        {   return macro_entry(type::KEY_DN, key);   }
 
         static macro_entry key_up(uint8_t key)
-        {   return macro_entry(type::KEY_UP, key, 0, 0);   }
+        {   return macro_entry(type::KEY_UP, key);   }
 
         static macro_entry repeat(uint16_t repeat)
-        {   return macro_entry(type::REPEAT, 0, repeat, 0);   }
+        {   return macro_entry(type::REPEAT, repeat);   }
 
         static macro_entry sleep(uint16_t delay_ms)
-        {   return macro_entry(type::SLEEP, 0, 0, delay_ms);   }
+        {   return macro_entry(type::SLEEP, delay_ms);   }
 
         bool operator==(macro_entry const &r) const
         {
-            return (type_     == r.type_    )
-                && (key_code_ == r.key_code_)
-                && (repeat_   == r.repeat_  )
-                && (delay_ms_ == r.delay_ms_);
+            return (type_ == r.type_)
+                && (hi_   == r.hi_  )
+                && (lo_   == r.lo_  );
         }
 
+        bool operator!=(macro_entry const &r) const
+        {   return !(*this == r);   }
+
         type get_type() const
         {   return type_;   }
 
-        uint8_t get_key_code() const
+        lobera_result<uint8_t> try_get_key_code() const noexcept
         {
             if ((type_ != type::KEY_DN) && (type_ != type::KEY_UP))
-                throw std::runtime_error("Invalid macro entry type");
-            return key_code_;
+                return lobera_errc::WRONG_ENTRY_TYPE;
+            return lo_;
         }
 
-        uint16_t get_repeat() const
+        lobera_result<uint16_t> try_get_repeat() const noexcept
         {
             if (type_ != type::REPEAT)
-                throw std::runtime_error("Invalid macro entry type");
-            return repeat_;
+                return lobera_errc::WRONG_ENTRY_TYPE;
+            return static_cast<uint16_t>((hi_ << 8) | lo_);
         }
 
-        uint16_t get_delay() const
+        lobera_result<uint16_t> try_get_delay() const noexcept
         {
             if (type_ != type::SLEEP)
-                throw std::runtime_error("Invalid macro entry type");
-            return delay_ms_;
+                return lobera_errc::WRONG_ENTRY_TYPE;
+            return static_cast<uint16_t>((hi_ << 8) | lo_);
         }
 
+        uint8_t get_key_code() const
+        {   return try_get_key_code().value();   }
+
+        uint16_t get_repeat() const
+        {   return try_get_repeat().value();   }
+
+        uint16_t get_delay() const
+        {   return try_get_delay().value();   }
+
     private:
         type     type_;
-        uint8_t  key_code_;
-        uint16_t delay_ms_;
-        uint16_t repeat_;
+        uint8_t  hi_;
+        uint8_t  lo_;
     };
+
     typedef std::vector<macro_entry> macro;
 
+    // Macro is only constructed for MACRO keys, it shares place with the
+    // substitution key code
     class key_setting
     {
     public:
-        enum struct type
+        enum struct type: uint8_t
         {
             DISABLE,
             SUBST,
@@ -117,35 +145,79 @@ public:
         key_setting(repeat_mode repeat = repeat_mode::SINGLE)
             : type_(type::DISABLE)
             , repeat_(repeat)
-            , subst_(0)
+            , raw_()
         {   }
 
         key_setting(macro && m, repeat_mode repeat = repeat_mode::SINGLE)
             : type_(type::MACRO)
             , repeat_(repeat)
-            , macro_(std::move(m))
-            , subst_(0)
-        {   }
+        {   new (&macro_) macro(std::move(m));   }
 
         key_setting(macro const & m, repeat_mode repeat = repeat_mode::SINGLE)
             : type_(type::MACRO)
             , repeat_(repeat)
-            , macro_(m)
-            , subst_(0)
-        {   }
+        {   new (&macro_) macro(m);   }
 
         key_setting(uint8_t subst, repeat_mode repeat = repeat_mode::SINGLE)
             : type_(type::SUBST)
             , repeat_(repeat)
-            , subst_(subst)
-        {   }
+            , raw_()
+        {   subst_ = subst;   }
+
+        key_setting(key_setting const & r)
+            : type_(r.type_)
+            , repeat_(r.repeat_)
+        {
+            if (type_ == type::MACRO)
+                new (&macro_) macro(r.macro_);
+            else
+                std::memcpy(raw_, r.raw_, sizeof(raw_));
+        }
+
+        key_setting(key_setting && r) noexcept
+            : type_(r.type_)
+            , repeat_(r.repeat_)
+        {
+            if (type_ == type::MACRO)
+                new (&macro_) macro(std::move(r.macro_));
+            else
+                std::memcpy(raw_, r.raw_, sizeof(raw_));
+        }
+
+        ~key_setting()
+        {
+            if (type_ == type::MACRO)
+                macro_.~macro();
+        }
+
+        key_setting & operator=(key_setting const & r)
+        {
+            if (this != &r)
+                *this = key_setting(r);
+            return *this;
+        }
+
+        key_setting & operator=(key_setting && r) noexcept
+        {
+            if (this != &r)
+            {
+                this->~key_setting();
+                new (this) key_setting(std::move(r));
+            }
+            return *this;
+        }
 
         bool operator==(key_setting const & r) const
         {
-            return (type_   == r.type_  )
-                && (repeat_ == r.repeat_)
-                && (macro_  == r.macro_ )
-                && (subst_  == r.subst_ );
+            if ((type_ != r.type_) || (repeat_ != r.repeat_))
+                return false;
+            switch (type_)
+            {
+                case type::DISABLE: return true;
+                case type::SUBST:   return subst_ == r.subst_;
+                case type::MACRO:   return macro_ == r.macro_;
+            }
+            return false;
         }
 
         type get_type() const
@@ -154,29 +226,144 @@ public:
         repeat_mode get_repeat_mode() const
         {   return repeat_; }
 
-        uint8_t get_subst_key() const
+        lobera_result<uint8_t> try_get_subst_key() const noexcept
         {
             if (type_ != type::SUBST)
-                throw std::runtime_error("Invalid key setting type");
+                return lobera_errc::WRONG_SETTING_TYPE;
             return subst_;
         }
 
-        macro const & get_macro() const
+        lobera_result<macro const *> try_get_macro() const noexcept
         {
             if (type_ != type::MACRO)
-                throw std::runtime_error("Invalid key setting type");
-            return macro_;
+                return lobera_errc::WRONG_SETTING_TYPE;
+            return &macro_;
         }
 
+        uint8_t get_subst_key() const
+        {   return try_get_subst_key().value();   }
+
+        macro const & get_macro() const
+        {   return *try_get_macro().value();   }
+
     private:
         type        type_;
         repeat_mode repeat_;
-        macro       macro_;
-        uint8_t     subst_;
+        // Whole storage is zeroed for DISABLE and SUBST keys, there's no
+        // stale macro in it
+        union
+        {
+            uint8_t subst_;
+            macro   macro_;
+            uint8_t raw_[sizeof(macro)];
+        };
     };
 
     typedef std::map<uint8_t /*key*/, key_setting> keys_settings;
 
+    // Receives keys one by one from streaming reads
+    typedef std::function<void(uint8_t key, key_setting && setting)> key_callback;
+
+    // Encoded form of keys_settings, exactly as it's transferred to the device
+    struct profile_image
+    {
+        std::vector<uint8_t> offsets;   // keys offsets table
+        std::vector<uint8_t> data;      // keys data, whole batches
+        std::vector<uint8_t> repeats;   // keys repeat modes
+
+        bool operator==(profile_image const & r) const
+        {
+            return (offsets == r.offsets)
+                && (data    == r.data   )
+                && (repeats == r.repeats);
+        }
+    };
+
+    // Image in memory owned by the caller, e.g. a mapped lobera_profile_store
+    struct profile_image_view
+    {
+        uint8_t const * offsets;            // OFFSETS_SIZE bytes
+        uint8_t const * data;               // whole batches
+        size_t          data_size;
+        uint8_t const * repeats;            // REPEAT_SIZE bytes
+        uint8_t const * thumbs = nullptr;   // BATCH_SIZE bytes, null leaves thumbs as they are
+        uint8_t         thumb_enabled[3] = {0, 0, 0};
+    };
+
+    // Contents of R_STATUS
+    struct status
+    {
+        bool       full_nkpo;
+        uint8_t    brightness;
+        light_mode mode;
+
+        bool operator==(status const & r) const
+        {
+            return (full_nkpo  == r.full_nkpo )
+                && (brightness == r.brightness)
+                && (mode       == r.mode      );
+        }
+    };
+
+    // Transfers an operation issues, as recorded by dry_run()
+    struct transfer
+    {
+        bool     write;
+        uint8_t  req_type;
+        uint16_t value;
+        uint16_t index;
+        size_t   size;
+        uint64_t start_ms;      // since operation start
+        uint64_t next_write_ms; // device cool-down requested by the transfer
+        uint64_t next_read_ms;
+    };
+
+    struct plan
+    {
+        std::vector<transfer> transfers;
+        size_t   bytes_read    = 0;
+        size_t   bytes_written = 0;
+        size_t   batches       = 0; // keys data batches written
+        uint64_t duration_ms   = 0; // until operation returns
+        uint64_t settle_ms     = 0; // until device accepts next transfer
+    };
+
+    // Full configuration of one profile, for apply_profiles()
+    struct profile_config
+    {
+        uint8_t              profile;
+        keys_settings        keys;
+        std::array<macro, 3> thumbs;
+    };
+
+    // Layout independent fingerprint of a profile: profiles with the same
+    // keys and thumb macros match however their key data is laid out
+    struct profile_fingerprint
+    {
+        uint64_t tables = 0; // keys, repeat modes, record types and lengths
+        uint64_t data   = 0; // key data referenced by the tables
+        uint64_t thumbs = 0; // enabled thumb macros
+
+        bool operator==(profile_fingerprint const & r) const
+        {
+            return (tables == r.tables)
+                && (data   == r.data  )
+                && (thumbs == r.thumbs);
+        }
+
+        bool operator!=(profile_fingerprint const & r) const
+        {   return !(*this == r);   }
+    };
+
+    struct apply_report
+    {
+        std::vector<transfer> transfers;     // in issue order
+        std::vector<size_t>   critical_path; // transfers that determined the end time
+        std::vector<uint8_t>  mismatches;    // profiles that failed verification
+        uint64_t              prepare_us  = 0;
+        uint64_t              duration_ms = 0;
+    };
+
 public:
     lobera_usb();
     virtual ~lobera_usb();
@@ -184,6 +371,16 @@ public:
     void open();
     void close();
 
+    // Connected keyboards as "bus/device" ids, open(device) opens one of them
+    static std::vector<std::string> list_devices();
+    void open(std::string const & device);
+
+    // Paces transfers to the open device together with other processes
+    // through a ledger in dir (see lobera_pacing_ledger.hpp). Operations
+    // hold the ledger for all their transfers, so other processes wait
+    // until the operation is done plus the remaining cool-down.
+    void share_pacing(std::string const & dir = "/dev/shm");
+
     uint8_t get_profile();
     void set_profile(uint8_t profile);
 
@@ -192,20 +389,200 @@ public:
     bool get_full_nkpo();
 
     light_mode get_light_mode();
+
+    // Brightness, NKPO and light mode in a single read
+    status get_status();
     void set_light_mode(light_mode mode);
 
     uint32_t get_profile_color(uint8_t profile);
     void set_profile_color(uint8_t profile, uint32_t rgb);
 
+    // All six colors at once, written without reading current ones
+    std::array<uint32_t, 6> get_profile_colors();
+    void set_profile_colors(std::array<uint32_t, 6> const & rgb);
+
     macro get_thumb_macro(uint8_t profile, uint8_t thumb);
     void set_thumb_macro(uint8_t profile, uint8_t thumb, macro const & macro);
 
+    // Both stream keys data a batch at a time: keys are decoded as their
+    // batch arrives and each batch is encoded while the previous write cools
+    // down, so no whole data block is held
     keys_settings get_profile_buttons(uint8_t profile);
     void set_profile_buttons(uint8_t profile, keys_settings const & settings);
 
-    void reset_config();
+    // Delivers keys as soon as their data is read, in data order. Batches no
+    // key references aren't read.
+    void read_profile_buttons(uint8_t profile, key_callback const & cb);
+
+    // Changes a single key without re-laying out the whole profile: new key
+    // data is appended to the tail of the data block (or overwrites the old
+    // data in place if it fits), only touched batches and tables are written.
+    // Dead space is reclaimed by compact_profile(), which set_key() calls by
+    // itself once dead bytes exceed the compaction threshold.
+    void set_key(uint8_t profile, uint8_t key, key_setting const & setting);
+    void compact_profile(uint8_t profile);
+    double get_compaction_threshold() const;
+    void set_compaction_threshold(double dead_ratio);
+
+    profile_image read_profile_image(uint8_t profile);
+    void write_profile_image(uint8_t profile, profile_image const & image);
+    void write_profile_image(uint8_t profile, profile_image_view const & image);
+
+    // Image compiler, doesn't need the device (see lobera_image.cpp). The
+    // second form reuses the buffers of image.
+    static profile_image compile_profile_image(keys_settings const & settings);
+    static void compile_profile_image(keys_settings const & settings, profile_image & image);
+    static keys_settings decode_profile_image(profile_image const & image);
+    static lobera_result<keys_settings> try_decode_profile_image(profile_image const & image) noexcept;
+
+    // Writes several profiles in one pass: everything is encoded before the
+    // first transfer, each thumb block is written once, and verification
+    // reads are issued whenever the device accepts reads but not writes
+    // (see lobera_pipeline.cpp)
+    apply_report apply_profiles(std::vector<profile_config> const & profiles, bool verify = true);
+
+    // Fingerprints (see lobera_audit.cpp). Reading one costs the two tables,
+    // the thumb flags and block, and the data batches the tables reference;
+    // the batches are skipped if the tables already differ from expected.
+    static profile_fingerprint fingerprint_profile(profile_config const & config);
+    profile_fingerprint read_profile_fingerprint(uint8_t profile, profile_fingerprint const * expected = nullptr);
+
+    // Only writes blocks that differ from defaults, unless forced
+    void reset_config(bool force = false);
+
+    // Bulk writes (profile images, reset, apply_profiles, set_key) keep a
+    // checkpoint of completed transfers. After a failure resume() continues
+    // from the failed transfer, retrying with growing delays between
+    // attempts. Starting another bulk write discards the checkpoint.
+    size_t pending_transfers() const;
+    void resume(size_t max_attempts = 5);
+    void discard_checkpoint();
+
+    // Publishes what is read and written to mirror (see lobera_mirror.hpp),
+    // nullptr detaches. The mirror must outlive the attachment.
+    void attach_mirror(lobera_mirror * mirror);
+
+    // Runs operation against a device-less instance: all capacity checks are
+    // done, transfers are recorded instead of being sent, pacing is counted
+    // instead of slept. Reads return zeroed data.
+    static plan dry_run(std::function<void(lobera_usb &)> const & op);
+
+    // Same, with the keys tables and data of profile backed by image: reads
+    // return its content and writes update it, so the plan follows the real
+    // layout (records rewritten in place, tail batch reads, compaction)
+    static plan dry_run(std::function<void(lobera_usb &)> const & op, uint8_t profile, profile_image & image);
+
+    static plan plan_profile_buttons(uint8_t profile, keys_settings const & settings);
+    static plan plan_profile_image(uint8_t profile, profile_image const & image);
+    static plan plan_thumb_macro(uint8_t profile, uint8_t thumb, macro const & macro);
+    static plan plan_profile_color(uint8_t profile, uint32_t rgb);
+    static plan plan_reset_config(); // forced reset
+
+protected:
+    // Transport and clock, overridden by the device simulator
+    virtual int control_msg(int         request_type,
+                            uint8_t     req_type,
+                            uint16_t    value,
+                            uint16_t    index,
+                            void      * data,
+                            size_t      size);
+    virtual uint64_t clock_ms();
+    virtual void sleep_ms(uint64_t ms);
 
 private:
+    // Holds the shared pacing ledger, if any, for the scope and keeps
+    // next_read_/next_write_ in sync with it
+    class pacing_hold
+    {
+    public:
+        explicit pacing_hold(lobera_usb & l) noexcept;
+        ~pacing_hold();
+
+        pacing_hold(pacing_hold const &) = delete;
+        pacing_hold & operator=(pacing_hold const &) = delete;
+
+    private:
+        lobera_usb & l_;
+    };
+
+    struct queued_write
+    {
+        uint8_t              req_type;
+        uint16_t             value;
+        uint16_t             index;
+        std::vector<uint8_t> data;
+        uint64_t             next_write_ms;
+        uint64_t             next_read_ms;
+    };
+
+    // Writes of one bulk operation. Slots and their payload buffers are kept
+    // for the next operation, so steady state queueing doesn't allocate.
+    class write_queue
+    {
+    public:
+        void clear()
+        {   size_ = 0;   }
+
+        size_t size() const
+        {   return size_;   }
+
+        queued_write const & operator[](size_t i) const
+        {   return slots_[i];   }
+
+        void push(uint8_t          req_type,
+                  uint16_t         value,
+                  uint16_t         index,
+                  void     const * data,
+                  size_t           size,
+                  uint64_t         next_write_ms,
+                  uint64_t         next_read_ms)
+        {
+            if (size_ == slots_.size())
+                slots_.emplace_back();
+            queued_write & w = slots_[size_++];
+            w.req_type      = req_type;
+            w.value         = value;
+            w.index         = index;
+            w.next_write_ms = next_write_ms;
+            w.next_read_ms  = next_read_ms;
+            uint8_t const * p = static_cast<uint8_t const *>(data);
+            w.data.assign(p, p + ((p != nullptr) ? size : 0));
+        }
+
+        void swap(write_queue & r)
+        {
+            slots_.swap(r.slots_);
+            std::swap(size_, r.size_);
+        }
+
+    private:
+        std::vector<queued_write> slots_;
+        size_t                    size_ = 0;
+    };
+
+    write_queue & begin_writes();
+    void queue_profile_image(write_queue & writes, uint8_t profile, profile_image_view const & image);
+    void run_writes();
+    void run_checkpoint();
+    void read_profile_image(uint8_t profile, profile_image & image);
+    void publish_keys(uint8_t profile, keys_settings const * keys); // nullptr if unknown
+
+    // Failed transfers come back as READ_FAILED/WRITE_FAILED with the libusb
+    // return code, read_data()/write_data() turn them into exceptions
+    lobera_result<size_t> try_read_data(uint8_t    req_type,
+                                        uint16_t   value,
+                                        uint16_t   index,
+                                        void     * data,
+                                        size_t     size,
+                                        uint64_t   next_write_ms,
+                                        uint64_t   next_read_ms) noexcept;
+    lobera_result<void> try_write_data(uint8_t          req_type,
+                                       uint16_t         value,
+                                       uint16_t         index,
+                                       void     const * data,
+                                       size_t           size,
+                                       uint64_t         next_write_ms,
+                                       uint64_t         next_read_ms) noexcept;
     size_t read_data(uint8_t    req_type,
                      uint16_t   value,
                      uint16_t   index,
@@ -222,7 +599,19 @@ private:
                     uint64_t         next_read_ms = 0);
 
 private:
-    usb_dev_handle * h_          = nullptr;
-    uint64_t         next_read_  = 0;
-    uint64_t         next_write_ = 0;
+    usb_dev_handle                        * h_                    = nullptr;
+    std::string                             device_;              // id of the open device
+    std::unique_ptr<lobera_pacing_ledger>   ledger_;              // shared pacing, if enabled
+    uint64_t                                next_read_            = 0;
+    uint64_t                                next_write_           = 0;
+    double                                  compaction_threshold_ = 0.5;
+    write_queue                             staging_;             // writes being queued
+    write_queue                             checkpoint_;          // writes being run
+    size_t                                  checkpoint_done_      = 0;
+    std::unique_ptr<lobera_arena>           arena_;               // transfer and codec buffers
+    lobera_mirror                         * mirror_               = nullptr;
+    plan                                  * dry_run_              = nullptr;
+    uint64_t                                dry_clock_            = 0;
+    uint8_t                                 dry_profile_          = 0;
+    profile_image                         * dry_image_            = nullptr;  // dry run device content, if any
 };
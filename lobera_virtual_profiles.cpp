@@ -0,0 +1,246 @@
+#include "lobera_virtual_profiles.hpp"
+#include "lobera_trace.hpp"
+
+#include <algorithm>
+
+// Activations after which LFU use counts are halved
+#define USES_DECAY_PERIOD 64
+
+lobera_virtual_profiles::lobera_virtual_profiles(lobera_usb                 & device,
+                                                 policy                       p,
+                                                 std::vector<uint8_t> const & slots)
+    : device_(device)
+    , policy_(p)
+{
+    if (slots.empty())
+        throw std::runtime_error("No profile slots");
+    for (uint8_t profile: slots)
+    {
+        if ((profile < 1) || (profile > 5) || (slot_of_profile(profile) != nullptr))
+            throw std::runtime_error("Invalid profile number");
+        slots_.push_back(slot{profile, std::string(), nullptr});
+    }
+}
+
+void lobera_virtual_profiles::define(std::string const & name, layout const & l)
+{
+    if (name.empty())
+        throw std::runtime_error("Empty layout name");
+    layouts_[name].content = std::make_shared<layout const>(l);
+}
+
+void lobera_virtual_profiles::remove(std::string const & name)
+{
+    // The device keeps the old content, a later write into the slot can
+    // still be patched from it
+    for (auto & s: slots_)
+    {
+        if (s.name == name)
+            s.name.clear();
+    }
+    layouts_.erase(name);
+}
+
+bool lobera_virtual_profiles::defined(std::string const & name) const
+{
+    return layouts_.count(name) != 0;
+}
+
+uint8_t lobera_virtual_profiles::activate(std::string const & name)
+{
+    LOBERA_TRACE_OP("virtual_activate");
+    auto it = layouts_.find(name);
+    if (it == layouts_.end())
+        throw std::runtime_error("Unknown layout: " + name);
+    entry & e = it->second;
+
+    e.last_use = ++tick_;
+    ++e.uses;
+    if (tick_ % USES_DECAY_PERIOD == 0)
+    {
+        for (auto & l: layouts_)
+            l.second.uses /= 2;
+    }
+
+    auto is = std::find_if(slots_.begin(), slots_.end(), [&](slot const & s) { return s.name == name; });
+    if ((is != slots_.end()) && (is->content == e.content))
+        ++stats_.hits;
+    else
+    {
+        ++stats_.misses;
+        if (is == slots_.end())
+        {
+            is = pick_victim();
+            if (!is->name.empty())
+                ++stats_.evictions;
+        }
+        write_slot(*is, *e.content);
+        is->name    = name;
+        is->content = e.content;
+    }
+
+    // Always written, the profile may have been switched on the keyboard
+    device_.set_profile(is->profile);
+    return is->profile;
+}
+
+uint8_t lobera_virtual_profiles::slot_of(std::string const & name) const
+{
+    auto it = layouts_.find(name);
+    for (auto const & s: slots_)
+    {
+        if ((it != layouts_.end()) && (s.name == name) && (s.content == it->second.content))
+            return s.profile;
+    }
+    return 0;
+}
+
+std::string lobera_virtual_profiles::resident(uint8_t profile) const
+{
+    slot const * s = slot_of_profile(profile);
+    if (s == nullptr)
+        throw std::runtime_error("Invalid profile number");
+    return s->name;
+}
+
+void lobera_virtual_profiles::scan()
+{
+    LOBERA_TRACE_OP("virtual_scan");
+    std::vector<std::pair<std::string, lobera_usb::profile_fingerprint>> fingerprints;
+    for (auto const & l: layouts_)
+    {
+        lobera_usb::profile_config config{1, l.second.content->keys, l.second.content->thumbs};
+        fingerprints.emplace_back(l.first, lobera_usb::fingerprint_profile(config));
+    }
+
+    for (auto & s: slots_)
+    {
+        s.name.clear();
+        s.content.reset();
+        lobera_usb::profile_fingerprint fp = device_.read_profile_fingerprint(s.profile);
+        for (auto const & f: fingerprints)
+        {
+            if (f.second == fp)
+            {
+                s.name    = f.first;
+                s.content = layouts_.at(f.first).content;
+                break;
+            }
+        }
+    }
+}
+
+lobera_virtual_profiles::slot const * lobera_virtual_profiles::slot_of_profile(uint8_t profile) const
+{
+    for (auto const & s: slots_)
+    {
+        if (s.profile == profile)
+            return &s;
+    }
+    return nullptr;
+}
+
+std::vector<lobera_virtual_profiles::slot>::iterator lobera_virtual_profiles::pick_victim()
+{
+    // Free slots go first
+    auto victim = slots_.end();
+    entry const * victim_entry = nullptr;
+    for (auto is = slots_.begin(); is != slots_.end(); ++is)
+    {
+        if (is->name.empty())
+            return is;
+
+        entry const & e = layouts_.at(is->name);
+        bool better = (victim == slots_.end());
+        if (!better && (policy_ == policy::LFU) && (e.uses != victim_entry->uses))
+            better = e.uses < victim_entry->uses;
+        else if (!better)
+            better = e.last_use < victim_entry->last_use;
+        if (better)
+        {
+            victim = is;
+            victim_entry = &e;
+        }
+    }
+    return victim;
+}
+
+void lobera_virtual_profiles::write_slot(slot & s, layout const & l)
+{
+    uint8_t const profile = s.profile;
+
+    // A failed write leaves the slot unknown
+    std::shared_ptr<layout const> old = std::move(s.content);
+    s.content.reset();
+    s.name.clear();
+
+    std::vector<uint8_t> thumbs;
+    for (uint8_t ithumb = 1; ithumb <= 3; ++ithumb)
+    {
+        if (!old || !(old->thumbs[ithumb - 1] == l.thumbs[ithumb - 1]))
+            thumbs.push_back(ithumb);
+    }
+    bool keys_differ = !old || !(old->keys == l.keys);
+
+    // Patching is set_key() per changed key and set_thumb_macro() per
+    // changed thumb, keys can't be removed that way
+    uint64_t patch_ms = 0;
+    for (uint8_t ithumb: thumbs)
+        patch_ms += lobera_usb::plan_thumb_macro(profile, ithumb, l.thumbs[ithumb - 1]).settle_ms;
+
+    if (!keys_differ)
+    {
+        for (uint8_t ithumb: thumbs)
+            device_.set_thumb_macro(profile, ithumb, l.thumbs[ithumb - 1]);
+        stats_.write_ms += patch_ms;
+        return;
+    }
+
+    lobera_usb::profile_config config{profile, l.keys, l.thumbs};
+    lobera_usb::plan full = thumbs.empty()
+                          ? lobera_usb::plan_profile_buttons(profile, l.keys)
+                          : lobera_usb::dry_run([&](lobera_usb & d) { d.apply_profiles({config}, false); });
+
+    std::vector<lobera_usb::keys_settings::value_type const *> changed;
+    bool patch = old && std::all_of(old->keys.begin(), old->keys.end(), [&](lobera_usb::keys_settings::value_type const & k) { return l.keys.count(k.first) != 0; });
+    for (auto it = l.keys.begin(); patch && (it != l.keys.end()); ++it)
+    {
+        auto iold = old->keys.find(it->first);
+        if ((iold == old->keys.end()) || !(iold->second == it->second))
+            changed.push_back(&*it);
+    }
+
+    // Planned against the layout a full write leaves, so reused records,
+    // tail batch reads and set_key()'s compaction fallback are all counted.
+    // Dead space left by earlier patches isn't known, it can only make
+    // compaction come sooner.
+    if (patch)
+    {
+        lobera_usb::profile_image image = lobera_usb::compile_profile_image(old->keys);
+        double threshold = device_.get_compaction_threshold();
+        patch_ms += lobera_usb::dry_run([&](lobera_usb & d) {
+            d.set_compaction_threshold(threshold);
+            for (auto const * k: changed)
+                d.set_key(profile, k->first, k->second);
+        }, profile, image).settle_ms;
+        patch = patch_ms < full.settle_ms;
+    }
+
+    if (patch)
+    {
+        for (auto const * k: changed)
+            device_.set_key(profile, k->first, k->second);
+        for (uint8_t ithumb: thumbs)
+            device_.set_thumb_macro(profile, ithumb, l.thumbs[ithumb - 1]);
+        stats_.write_ms += patch_ms;
+        ++stats_.patched;
+    }
+    else
+    {
+        if (thumbs.empty())
+            device_.set_profile_buttons(profile, l.keys);
+        else
+            device_.apply_profiles({config}, false);
+        stats_.write_ms += full.settle_ms;
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+
+#include <map>
+#include <memory>
+
+//
+// Maps any number of named layouts onto the hardware profile slots.
+//
+// Tracks which layout each slot holds. Activating a resident layout is a
+// single W_PROFILE write. Otherwise the layout is written into a victim
+// slot picked by the eviction policy and then switched to; keys that differ
+// from what the victim holds are patched with set_key() when the dry run
+// estimate says that's faster than rewriting the profile.
+//
+// Slot contents start unknown, scan() matches them to defined layouts by
+// fingerprint. Not thread safe, the device must not be written behind the
+// manager's back.
+//
+class lobera_virtual_profiles
+{
+public:
+    struct layout
+    {
+        lobera_usb::keys_settings        keys;
+        std::array<lobera_usb::macro, 3> thumbs;
+    };
+
+    enum struct policy : uint8_t
+    {
+        LRU, // least recently activated
+        LFU, // least often activated (counts decay over time), ties by LRU
+    };
+
+    struct stats
+    {
+        size_t   hits      = 0; // activations of resident layouts
+        size_t   misses    = 0;
+        size_t   evictions = 0; // resident layouts replaced
+        size_t   patched   = 0; // misses written with set_key()
+        uint64_t write_ms  = 0; // estimated device time of miss writes
+    };
+
+public:
+    explicit lobera_virtual_profiles(lobera_usb                 & device,
+                                     policy                       p     = policy::LFU,
+                                     std::vector<uint8_t> const & slots = {1, 2, 3, 4, 5});
+
+    // Adds or replaces a layout, a resident copy is updated on next activation
+    void define(std::string const & name, layout const & l);
+    void remove(std::string const & name);
+    bool defined(std::string const & name) const;
+
+    // Makes the layout the active profile, returns its slot
+    uint8_t activate(std::string const & name);
+
+    // Slot holding the layout, 0 if not resident
+    uint8_t slot_of(std::string const & name) const;
+
+    // Layout held by slot, empty if none or unknown
+    std::string resident(uint8_t slot) const;
+
+    // Reads slot fingerprints and marks those matching a layout as resident
+    void scan();
+
+    stats const & get_stats() const
+    {   return stats_;   }
+
+private:
+    struct entry
+    {
+        std::shared_ptr<layout const> content;
+        uint64_t                      last_use = 0;
+        uint32_t                      uses     = 0;
+    };
+
+    struct slot
+    {
+        uint8_t                       profile;
+        std::string                   name;     // empty if no layout
+        std::shared_ptr<layout const> content;  // what the device holds, null if unknown
+    };
+
+    slot const * slot_of_profile(uint8_t profile) const;
+    std::vector<slot>::iterator pick_victim();
+    void write_slot(slot & s, layout const & l);
+
+private:
+    lobera_usb                   & device_;
+    policy                         policy_;
+    std::map<std::string, entry>   layouts_;
+    std::vector<slot>              slots_;
+    uint64_t                       tick_ = 0;
+    stats                          stats_;
+};
@@ -0,0 +1,127 @@
+#include "lobera_watcher.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+lobera_watcher::lobera_watcher(lobera_usb & device, uint64_t min_interval_ms, uint64_t max_interval_ms)
+    : device_(device)
+    , min_interval_ms_(min_interval_ms)
+    , max_interval_ms_(std::max(min_interval_ms, max_interval_ms))
+{
+    thread_ = std::thread(&lobera_watcher::run, this);
+}
+
+lobera_watcher::~lobera_watcher()
+{
+    stop();
+}
+
+std::shared_ptr<lobera_watcher::subscription> lobera_watcher::subscribe()
+{
+    auto s = std::make_shared<subscription>();
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.push_back(s);
+    return s;
+}
+
+void lobera_watcher::unsubscribe(std::shared_ptr<subscription> const & s)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), s), subscribers_.end());
+}
+
+lobera_watcher::state lobera_watcher::current() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return current_;
+}
+
+void lobera_watcher::poke()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    poked_ = true;
+    cv_.notify_one();
+}
+
+void lobera_watcher::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cv_.notify_one();
+    }
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void lobera_watcher::run()
+{
+    bool     first    = true;
+    uint64_t interval = min_interval_ms_;
+
+    for (;;)
+    {
+        state s;
+        bool polled = true;
+        {
+            std::lock_guard<std::mutex> lock(device_mutex_);
+            try
+            {
+                s.profile = device_.get_profile();
+                s.status  = device_.get_status();
+            }
+            catch (std::exception const &)
+            {
+                // Transient errors are retried on the next poll
+                polled = false;
+            }
+        }
+
+        // Nothing is published until a poll succeeded, not even the
+        // initial state
+        uint32_t changed = 0;
+        if (polled)
+        {
+            state prev = current();
+            if (first || (s.profile != prev.profile))
+                changed |= event::PROFILE;
+            if (first || (s.status.mode != prev.status.mode))
+                changed |= event::LIGHT_MODE;
+            if (first || (s.status.brightness != prev.status.brightness))
+                changed |= event::BRIGHTNESS;
+            if (first || (s.status.full_nkpo != prev.status.full_nkpo))
+                changed |= event::FULL_NKPO;
+            first = false;
+        }
+
+        if (changed != 0)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                current_ = s;
+            }
+            publish(event{changed, s});
+            interval = min_interval_ms_;
+        }
+        else
+            interval = std::min(interval * 2, max_interval_ms_);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::milliseconds(interval), [this] { return poked_ || stop_; });
+        if (stop_)
+            break;
+        if (poked_)
+            interval = min_interval_ms_;
+        poked_ = false;
+    }
+}
+
+void lobera_watcher::publish(event const & e)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto const & s: subscribers_)
+    {
+        if (!s->queue_.try_push(e))
+            s->overflows_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "lobera_usb.hpp"
+#include "lobera_spsc_queue.hpp"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+//
+// Polls active profile and status from one background thread and
+// publishes changes to any number of subscribers.
+//
+// Polling is fast right after a change (or after with_device()) and backs
+// off while the device is idle. Each subscriber gets its own lock-free
+// queue, so consumers never block the poll thread or each other.
+//
+class lobera_watcher
+{
+public:
+    struct state
+    {
+        uint8_t            profile = 0;
+        lobera_usb::status status  = {false, 0, lobera_usb::light_mode::OFF};
+    };
+
+    struct event
+    {
+        enum : uint32_t
+        {
+            PROFILE    = 0x01,
+            LIGHT_MODE = 0x02,
+            BRIGHTNESS = 0x04,
+            FULL_NKPO  = 0x08,
+        };
+
+        uint32_t changed;
+        state    current;
+    };
+
+    class subscription
+    {
+        friend class lobera_watcher;
+
+    public:
+        // Non-blocking, returns false if there are no new events
+        bool poll(event & e)
+        {   return queue_.try_pop(e);   }
+
+        // Events dropped because the subscriber didn't keep up,
+        // lobera_watcher::current() has the latest state then
+        size_t overflows() const
+        {   return overflows_.load(std::memory_order_relaxed);   }
+
+    private:
+        lobera_spsc_queue<event, 64> queue_;
+        std::atomic<size_t>          overflows_{0};
+    };
+
+public:
+    lobera_watcher(lobera_usb & device, uint64_t min_interval_ms = 50, uint64_t max_interval_ms = 2000);
+    ~lobera_watcher();
+
+    std::shared_ptr<subscription> subscribe();
+    void unsubscribe(std::shared_ptr<subscription> const & s);
+
+    state current() const;
+
+    // Runs f with exclusive access to the device, then polls fast again
+    template<class F>
+    auto with_device(F && f) -> decltype(f(std::declval<lobera_usb &>()))
+    {
+        struct activity
+        {
+            lobera_watcher * w;
+            ~activity() { w->poke(); }
+        } a{this};
+        std::lock_guard<std::mutex> lock(device_mutex_);
+        return f(device_);
+    }
+
+    // Switches back to fast polling
+    void poke();
+
+    void stop();
+
+private:
+    void run();
+    void publish(event const & e);
+
+private:
+    lobera_usb                                & device_;
+    uint64_t                                    min_interval_ms_;
+    uint64_t                                    max_interval_ms_;
+
+    std::mutex                                  device_mutex_;
+
+    mutable std::mutex                          mutex_;
+    std::condition_variable                     cv_;
+    std::vector<std::shared_ptr<subscription>>  subscribers_;
+    state                                       current_;
+    bool                                        poked_ = false;
+    bool                                        stop_  = false;
+
+    std::thread                                 thread_;
+};
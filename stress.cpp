@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include "lobera_codec.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_sim.hpp"
+
+//
+// Randomized round-trip stress of the profile codec.
+//
+// Generates valid keys settings and thumb macros, biased towards the
+// capacity limits (MAX_KEYS keys, MAX_DATA_SIZE bytes of keys data, full
+// thumb blocks, extreme entry values), and checks that each encoder and
+// decoder pair gives them back unchanged:
+//   image   compile_profile_image() / try_decode_profile_image()
+//   stream  keys_stream_encoder batches against the image, and
+//           keys_stream_decoder fed in random chunks
+//   thumbs  encode_macro_entries() / decode_macro_entries() in a thumb block
+//   device  set_profile_buttons(), set_key(), set_thumb_macro() and reads
+//           on the simulator, for every DEVICE_EVERY-th profile
+//
+// Profile i is generated from seed + i, a failure prints the command that
+// reproduces it alone.
+//
+// Throughput of each pair is a JSON object per line, like bench:
+//   {"name": ..., "profiles": N, "profiles_per_s": ..., "mb_per_s": ...}
+// mb_per_s counts keys data bytes (thumb block bytes for thumbs).
+//
+// Usage: stress [seconds] [seed]
+//
+
+#define STRESS_SECONDS 10
+#define DEVICE_EVERY   64
+
+namespace
+{
+    //
+    // Generator
+    //
+    class profile_generator
+    {
+    public:
+        explicit profile_generator(uint64_t seed)
+            : rng_(seed)
+        {   }
+
+        lobera_usb::keys_settings keys()
+        {
+            switch (below(5))
+            {
+                case 0:  return build(below(8), below(MAX_DATA_SIZE + 1), 50, false);
+                case 1:  return build(MAX_KEYS, MAX_KEYS + below(4096), 10, false);     // every key slot
+                case 2:  return build(1 + below(MAX_KEYS), MAX_DATA_SIZE, 70, true);    // every data byte
+                case 3:  return build(1, MAX_DATA_SIZE, 100, true);                     // longest macro
+                default: return build(below(MAX_KEYS + 1), below(MAX_DATA_SIZE + 1), 50, below(2) == 0);
+            }
+        }
+
+        // Empty means no thumb macro
+        lobera_usb::macro thumb()
+        {
+            size_t max_entries = THUMB_MAX_MACRO / 3;
+            return make_macro(below(4) == 0 ? max_entries : below(max_entries + 1));
+        }
+
+        lobera_usb::key_setting setting(size_t max_size)
+        {
+            lobera_usb::repeat_mode mode = static_cast<lobera_usb::repeat_mode>(1 + below(3));
+            if ((max_size >= 3) && (below(2) == 0))
+                return lobera_usb::key_setting(make_macro(1 + below(std::min<size_t>(max_size / 3, 64))), mode);
+            if (below(8) == 0)
+                return lobera_usb::key_setting(mode);
+            return lobera_usb::key_setting(static_cast<uint8_t>(below(KEY_CODE_DISABLE)), mode);
+        }
+
+        size_t below(size_t n)
+        {
+            return std::uniform_int_distribution<size_t>(0, n - 1)(rng_);
+        }
+
+    private:
+        // n keys sharing budget bytes of keys data, at least one byte each;
+        // with fill the last macro takes all that's left
+        lobera_usb::keys_settings build(size_t n, size_t budget, size_t macro_percent, bool fill)
+        {
+            std::vector<uint8_t> codes(255);
+            std::iota(codes.begin(), codes.end(), 1); // 0 ends the repeats table
+            std::shuffle(codes.begin(), codes.end(), rng_);
+
+            budget = std::max(budget, n);
+            lobera_usb::keys_settings ret;
+            for (size_t i = 0; i < n; ++i)
+            {
+                lobera_usb::repeat_mode mode = static_cast<lobera_usb::repeat_mode>(1 + below(3));
+                size_t avail = budget - (n - i - 1);
+                if ((avail >= 3) && (below(100) < macro_percent))
+                {
+                    size_t max_entries = avail / 3;
+                    size_t entries = (fill && (i == n - 1)) ? max_entries : 1 + below(max_entries);
+                    ret.emplace(codes[i], lobera_usb::key_setting(make_macro(entries), mode));
+                    budget -= entries * 3;
+                }
+                else
+                {
+                    if (below(8) == 0)
+                        ret.emplace(codes[i], lobera_usb::key_setting(mode));
+                    else
+                        ret.emplace(codes[i], lobera_usb::key_setting(static_cast<uint8_t>(below(KEY_CODE_DISABLE)), mode));
+                    budget -= 1;
+                }
+            }
+            return ret;
+        }
+
+        lobera_usb::macro make_macro(size_t entries)
+        {
+            lobera_usb::macro m;
+            for (size_t i = 0; i < entries; ++i)
+            {
+                switch (below(4))
+                {
+                    case 0:  m.push_back(lobera_usb::macro_entry::key_dn(static_cast<uint8_t>(below(256)))); break;
+                    case 1:  m.push_back(lobera_usb::macro_entry::key_up(static_cast<uint8_t>(below(256)))); break;
+                    case 2:  m.push_back(lobera_usb::macro_entry::repeat(value16()));                         break;
+                    default: m.push_back(lobera_usb::macro_entry::sleep(value16()));                          break;
+                }
+            }
+            return m;
+        }
+
+        // Byte boundaries often, they're where encoding bugs show
+        uint16_t value16()
+        {
+            static uint16_t const EDGES[] = {0, 1, 0xff, 0x100, 0x7fff, 0x8000, 0xfffe, 0xffff};
+            if (below(4) == 0)
+                return EDGES[below(sizeof(EDGES) / sizeof(EDGES[0]))];
+            return static_cast<uint16_t>(below(0x10000));
+        }
+
+    private:
+        std::mt19937_64 rng_;
+    };
+
+    //
+    // Checks
+    //
+    struct phase
+    {
+        char const * name;
+        size_t       profiles = 0;
+        uint64_t     bytes    = 0;
+        uint64_t     ns       = 0;
+    };
+
+    enum
+    {
+        IMAGE_ENCODE,
+        IMAGE_DECODE,
+        STREAM_ENCODE,
+        STREAM_DECODE,
+        THUMBS,
+        DEVICE,
+        NUM_PHASES
+    };
+
+    phase phases[NUM_PHASES] = {
+        {"image_encode"},
+        {"image_decode"},
+        {"stream_encode"},
+        {"stream_decode"},
+        {"thumbs"},
+        {"device"},
+    };
+
+    // Runs f as part of phase p
+    template<class F>
+    auto timed(size_t p, uint64_t bytes, F && f) -> decltype(f())
+    {
+        struct account
+        {
+            phase                                 & ph;
+            std::chrono::steady_clock::time_point   start;
+            ~account()
+            {
+                ph.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            }
+        } a{phases[p], std::chrono::steady_clock::now()};
+        ++phases[p].profiles;
+        phases[p].bytes += bytes;
+        return f();
+    }
+
+    void check_keys(lobera_usb::keys_settings const & expected, lobera_usb::keys_settings const & actual, char const * what)
+    {
+        if (expected == actual)
+            return;
+        std::string msg = std::string(what) + ": " + std::to_string(actual.size()) + " keys, expected " + std::to_string(expected.size());
+        for (auto const & k: expected)
+        {
+            auto it = actual.find(k.first);
+            if ((it == actual.end()) || !(it->second == k.second))
+            {
+                msg += ", first difference at key " + std::to_string(k.first);
+                break;
+            }
+        }
+        throw std::runtime_error(msg);
+    }
+
+    void check_image(lobera_usb::keys_settings const & keys, lobera_usb::profile_image & image)
+    {
+        size_t data_size = lobera_codec::encode_keys_settings(keys, nullptr, 0);
+        timed(IMAGE_ENCODE, data_size, [&] { lobera_usb::compile_profile_image(keys, image); });
+        auto decoded = timed(IMAGE_DECODE, data_size, [&] { return lobera_usb::try_decode_profile_image(image); });
+        if (!decoded)
+            throw std::runtime_error("image: " + lobera_error_message(decoded.error()));
+        check_keys(keys, *decoded, "image");
+    }
+
+    void check_stream(profile_generator & gen, lobera_usb::keys_settings const & keys, lobera_usb::profile_image const & image)
+    {
+        size_t data_size = lobera_codec::encode_keys_settings(keys, nullptr, 0);
+
+        static std::vector<uint8_t> data;
+        timed(STREAM_ENCODE, data_size, [&] {
+            lobera_codec::keys_stream_encoder encoder(keys);
+            data.resize(encoder.num_batches() * BATCH_SIZE);
+            for (uint8_t * p = data.data(); encoder.next_batch(p); p += BATCH_SIZE)
+            {   }
+        });
+        if (data != image.data)
+            throw std::runtime_error("stream: batches differ from the image");
+
+        // Chunks up to two batches, not aligned to records or batches
+        std::vector<size_t> chunks;
+        for (size_t pos = 0; pos < image.data.size(); pos += chunks.back())
+            chunks.push_back(1 + gen.below(2 * BATCH_SIZE));
+
+        auto offsets = lobera_codec::decode_offset_entries(image.offsets.data(), image.offsets.size());
+        auto repeats = lobera_codec::decode_repeat_entries(image.repeats.data(), image.repeats.size());
+        lobera_usb::keys_settings decoded;
+        timed(STREAM_DECODE, data_size, [&] {
+            lobera_codec::keys_stream_decoder decoder;
+            decoder.reset(offsets, repeats, image.data.size()).value();
+            size_t pos = 0;
+            for (size_t i = 0; !decoder.done(); ++i)
+            {
+                pos = std::max(pos, decoder.next_needed());
+                size_t size = std::min(chunks[i % chunks.size()], image.data.size() - pos);
+                decoder.feed(pos, image.data.data() + pos, size, [&](uint8_t key, lobera_usb::key_setting && setting) {
+                    decoded.emplace(key, std::move(setting));
+                }).value();
+                pos += size;
+            }
+        });
+        check_keys(keys, decoded, "stream");
+    }
+
+    void check_thumbs(std::array<lobera_usb::macro, 3> const & thumbs)
+    {
+        uint8_t block[BATCH_SIZE];
+        std::array<lobera_usb::macro, 3> decoded;
+        timed(THUMBS, sizeof(block), [&] {
+            std::memset(block, 0, sizeof(block));
+            for (size_t i = 0; i < thumbs.size(); ++i)
+                lobera_codec::encode_macro_entries(thumbs[i], block + i * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+            for (size_t i = 0; i < thumbs.size(); ++i)
+                decoded[i] = lobera_codec::decode_macro_entries(block + i * THUMB_MAX_MACRO, THUMB_MAX_MACRO);
+        });
+        for (size_t i = 0; i < thumbs.size(); ++i)
+        {
+            if (!(decoded[i] == thumbs[i]))
+                throw std::runtime_error("thumbs: thumb " + std::to_string(i + 1) + " differs");
+        }
+    }
+
+    void check_device(profile_generator & gen, lobera_sim & sim, lobera_usb::keys_settings keys, std::array<lobera_usb::macro, 3> const & thumbs)
+    {
+        uint8_t profile = static_cast<uint8_t>(1 + gen.below(5));
+        size_t data_size = lobera_codec::encode_keys_settings(keys, nullptr, 0);
+        timed(DEVICE, data_size, [&] {
+            sim.set_profile_buttons(profile, keys);
+            check_keys(keys, sim.get_profile_buttons(profile), "device");
+
+            // Changes an existing key when keys or data are full, a new one
+            // wouldn't fit
+            uint8_t key = static_cast<uint8_t>(1 + gen.below(255));
+            if (((keys.size() == MAX_KEYS) || (data_size == MAX_DATA_SIZE)) && (keys.count(key) == 0))
+                key = keys.begin()->first;
+            auto it = keys.find(key);
+            size_t old_size = (it != keys.end()) ? lobera_codec::encode_key_setting(it->second, nullptr, 0, 0) : 0;
+            lobera_usb::key_setting setting = gen.setting(MAX_DATA_SIZE - (data_size - old_size));
+            sim.set_key(profile, key, setting);
+            keys.erase(key);
+            keys.emplace(key, setting);
+            check_keys(keys, sim.get_profile_buttons(profile), "device set_key");
+
+            for (uint8_t ithumb = 1; ithumb <= 3; ++ithumb)
+                sim.set_thumb_macro(profile, ithumb, thumbs[ithumb - 1]);
+            for (uint8_t ithumb = 1; ithumb <= 3; ++ithumb)
+            {
+                if (!(sim.get_thumb_macro(profile, ithumb) == thumbs[ithumb - 1]))
+                    throw std::runtime_error("device: thumb " + std::to_string(ithumb) + " differs");
+            }
+        });
+    }
+
+    void report(phase const & p)
+    {
+        double s = p.ns / 1e9;
+        std::cout << "{\"name\": \"" << p.name << "\""
+                  << ", \"profiles\": " << p.profiles
+                  << ", \"profiles_per_s\": " << (s > 0 ? p.profiles / s : 0)
+                  << ", \"mb_per_s\": " << (s > 0 ? p.bytes / s / 1e6 : 0)
+                  << "}" << std::endl;
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    uint64_t seconds = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : STRESS_SECONDS;
+    uint64_t seed    = (argc > 2) ? std::strtoull(argv[2], nullptr, 10) : std::random_device()();
+
+    lobera_sim sim(false);
+    lobera_usb::profile_image image;
+    auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+    size_t i = 0;
+    do
+    {
+        profile_generator gen(seed + i);
+        try
+        {
+            lobera_usb::keys_settings keys = gen.keys();
+            std::array<lobera_usb::macro, 3> thumbs = {gen.thumb(), gen.thumb(), gen.thumb()};
+
+            check_image(keys, image);
+            check_stream(gen, keys, image);
+            check_thumbs(thumbs);
+            if (i % DEVICE_EVERY == 0)
+                check_device(gen, sim, keys, thumbs);
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "FAIL profile " << i << " (seed " << seed + i << "): " << e.what() << std::endl
+                      << "Reproduce with: stress 0 " << seed + i << std::endl;
+            return 1;
+        }
+        ++i;
+    }
+    while (std::chrono::steady_clock::now() < end);
+
+    std::cerr << "ok: " << i << " profiles, seed " << seed << std::endl;
+    for (auto const & p: phases)
+        report(p);
+    return 0;
+}
@@ -1,6 +1,19 @@
+#include <chrono>
+#include <fstream>
 #include <iostream>
 #include <functional>
 #include "lobera_usb.hpp"
+#include "lobera_image.hpp"
+#include "lobera_codec.hpp"
+#include "lobera_audit.hpp"
+#include "lobera_virtual_profiles.hpp"
+#include "lobera_store.hpp"
+#include "lobera_mirror.hpp"
+#include "lobera_sim.hpp"
+#include "lobera_protocol.hpp"
+#include "lobera_simd.hpp"
+#include "lobera_color_stream.hpp"
+#include "lobera_watcher.hpp"
 
 #define TEST_FN(X) {#X, X}
 #define TEST_CHECK(X) { if !(X) throw std::runtime_error("Fail at line " + std::to_string(__LINE__) + ": " #X " is not true"); }
@@ -86,6 +99,95 @@ void test_set_color()
     l.set_profile_color(3, c3);
 }
 
+void test_color_stream()
+{
+    lobera_usb l;
+    l.open();
+
+    auto original = l.get_profile_colors();
+    {
+        lobera_color_stream stream(l);
+        for (uint32_t c = 0; c < 0x100; ++c)
+            stream.set_color(1, c);
+        stream.flush();
+        TEST_CHECK_EQUAL(stream.frames_written() + stream.frames_dropped(), 0x100u);
+    }
+    TEST_CHECK_EQUAL(l.get_profile_color(1), 0xffu);
+    TEST_CHECK_EQUAL(l.get_profile_color(2), original[2]);
+
+    // Restore
+    l.set_profile_colors(original);
+    TEST_CHECK_EQUAL(l.get_profile_colors(), original);
+}
+
+void test_color_stream_sim()
+{
+    // Cool-downs take real time, 1 ms per 10 ms of device time
+    struct slow_sim: lobera_sim
+    {
+        void sleep_ms(uint64_t ms) override
+        {
+            lobera_sim::sleep_ms(ms);
+            std::this_thread::sleep_for(std::chrono::milliseconds(ms / 10));
+        }
+    };
+
+    // The second frame is being written and the third is pending when the
+    // stream is destroyed, the third is still written
+    slow_sim l;
+    lobera_color_stream::frame f = l.get_profile_colors();
+    {
+        lobera_color_stream stream(l);
+        for (uint32_t c = 1; c <= 3; ++c)
+        {
+            f[1] = c;
+            stream.push(f);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    TEST_CHECK_EQUAL(l.get_profile_colors(), f);
+}
+
+void test_watcher()
+{
+    lobera_usb l;
+    l.open();
+
+    lobera_watcher w(l, 10, 100);
+    auto s = w.subscribe();
+    auto original = w.with_device([](lobera_usb & d) { return d.get_profile(); });
+
+    uint8_t profile = (original == 5) ? 4 : 5;
+    w.with_device([profile](lobera_usb & d) { d.set_profile(profile); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+    lobera_watcher::event e;
+    bool seen = false;
+    while (s->poll(e))
+        seen = seen || ((e.changed & lobera_watcher::event::PROFILE) && (e.current.profile == profile));
+    TEST_CHECK_EQUAL(seen, true);
+    TEST_CHECK_EQUAL(w.current().profile, profile);
+
+    // Restore
+    w.with_device([original](lobera_usb & d) { d.set_profile(original); });
+}
+
+void test_watcher_sim()
+{
+    // Failed first polls publish nothing, the first event is the real state
+    lobera_sim l;
+    l.fail_transfers(0, 3);
+    lobera_watcher w(l, 10, 100);
+    auto s = w.subscribe();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    lobera_watcher::event e;
+    TEST_CHECK_EQUAL(s->poll(e), true);
+    TEST_CHECK_EQUAL(e.current.profile, 1);
+    TEST_CHECK_EQUAL(e.current.status.mode, lobera_usb::light_mode::SINGLE);
+    TEST_CHECK_EQUAL(w.current().profile, 1);
+}
+
 void test_set_light_mode()
 {
     lobera_usb l;
@@ -145,6 +247,23 @@ void test_set_macro()
     l.set_thumb_macro(1, 2, m2);
 }
 
+void test_macro_entry()
+{
+    TEST_CHECK_EQUAL(sizeof(lobera_usb::macro_entry), 3u);
+    TEST_CHECK_EQUAL(lobera_usb::macro_entry::sleep(1000).get_delay(), 1000);
+
+    lobera_usb::macro m;
+    for (uint16_t i = 0; i < 100; ++i)
+        m.push_back(lobera_usb::macro_entry::repeat(i));
+    lobera_usb::key_setting k(m);
+    TEST_CHECK_EQUAL(k.get_macro(), m);
+    TEST_CHECK_EQUAL(k.get_macro()[99].get_repeat(), 99);
+
+    // Macro storage is released when the key changes type
+    k = lobera_usb::key_setting(0x16);
+    TEST_CHECK_EQUAL(k.get_subst_key(), 0x16);
+}
+
 void test_set_keys()
 {
     lobera_usb l;
@@ -174,6 +293,612 @@ void test_set_keys()
     l.set_profile_buttons(4, original_settings);
 }
 
+void test_set_key()
+{
+    lobera_usb l;
+    l.open();
+
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(0x16, lobera_usb::repeat_mode::PRESS));
+    settings.emplace(0x20, lobera_usb::key_setting());
+    l.set_profile_buttons(4, settings);
+
+    lobera_usb::macro const m = {
+        lobera_usb::macro_entry::key_dn(0x04),
+        lobera_usb::macro_entry::sleep(50),
+        lobera_usb::macro_entry::key_up(0x04),
+    };
+
+    // Append new key, grow existing one, shrink it back in place
+    settings.emplace(0x1f, lobera_usb::key_setting(m, lobera_usb::repeat_mode::NEXT));
+    l.set_key(4, 0x1f, settings.at(0x1f));
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), settings);
+
+    settings.at(0x1e) = lobera_usb::key_setting(m);
+    l.set_key(4, 0x1e, settings.at(0x1e));
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), settings);
+
+    settings.at(0x1e) = lobera_usb::key_setting(0x17);
+    l.set_key(4, 0x1e, settings.at(0x1e));
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), settings);
+
+    l.compact_profile(4);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), settings);
+
+    // restore
+    l.set_profile_buttons(4, lobera_usb::keys_settings{});
+}
+
+void test_apply_profiles()
+{
+    lobera_usb l;
+    l.open();
+
+    lobera_usb::macro const m = {
+        lobera_usb::macro_entry::key_dn(0x04),
+        lobera_usb::macro_entry::sleep(50),
+        lobera_usb::macro_entry::key_up(0x04),
+    };
+    lobera_usb::profile_config c4, c5;
+    c4.profile = 4;
+    c4.keys.emplace(0x1e, lobera_usb::key_setting(m));
+    c4.thumbs = {m, lobera_usb::macro{}, lobera_usb::macro{}};
+    c5.profile = 5;
+    c5.keys.emplace(0x1f, lobera_usb::key_setting(0x16));
+
+    auto report = l.apply_profiles({c4, c5});
+    TEST_CHECK_EQUAL(report.mismatches.empty(), true);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), c4.keys);
+    TEST_CHECK_EQUAL(l.get_thumb_macro(4, 1), m);
+
+    // restore
+    c4.keys.clear();
+    c4.thumbs = {};
+    c5.keys.clear();
+    l.apply_profiles({c4, c5}, false);
+}
+
+void test_apply_profiles_sim()
+{
+    lobera_usb::macro const m = {
+        lobera_usb::macro_entry::key_dn(0x04),
+        lobera_usb::macro_entry::key_up(0x04),
+    };
+    lobera_usb::profile_config c4, c5;
+    c4.profile = 4;
+    c4.keys.emplace(0x1e, lobera_usb::key_setting(m));
+    c4.thumbs = {m, lobera_usb::macro{}, lobera_usb::macro{}};
+    c5.profile = 5;
+    c5.keys.emplace(0x1f, lobera_usb::key_setting(0x16));
+
+    lobera_sim l;
+    auto report = l.apply_profiles({c4, c5});
+    TEST_CHECK_EQUAL(report.mismatches.empty(), true);
+    TEST_CHECK_EQUAL(l.get_stats().violations, 0u);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), c4.keys);
+    TEST_CHECK_EQUAL(l.get_thumb_macro(4, 1), m);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(5), c5.keys);
+}
+
+void test_profile_image()
+{
+    lobera_usb::keys_settings settings;
+    lobera_usb::macro const m = {
+        lobera_usb::macro_entry::key_dn(0x04),
+        lobera_usb::macro_entry::sleep(50),
+        lobera_usb::macro_entry::key_up(0x04),
+    };
+    settings.emplace(0x1e, lobera_usb::key_setting(m,    lobera_usb::repeat_mode::NEXT));
+    settings.emplace(0x1f, lobera_usb::key_setting(0x16, lobera_usb::repeat_mode::PRESS));
+    settings.emplace(0x20, lobera_usb::key_setting());
+
+    auto image = lobera_usb::compile_profile_image(settings);
+    TEST_CHECK_EQUAL(lobera_usb::decode_profile_image(image), settings);
+
+    lobera_image_cache cache("/tmp/lobera_test_cache");
+    TEST_CHECK_EQUAL(cache.compile(settings), image);
+    TEST_CHECK_EQUAL(cache.compile(settings), image); // from cache
+
+    // Truncated cache file is recompiled and replaced
+    std::ofstream(cache.path(hash_keys_settings(settings)), std::ios::binary | std::ios::trunc) << "LBIM";
+    TEST_CHECK_EQUAL(cache.compile(settings), image);
+    TEST_CHECK_EQUAL(cache.compile(settings), image);
+
+    // Corrupt batch count is rejected before allocating for it
+    std::ofstream(cache.path(hash_keys_settings(settings)), std::ios::binary | std::ios::trunc) << std::string("LBIM\x01\xff\xff", 7);
+    std::ifstream corrupt(cache.path(hash_keys_settings(settings)), std::ios::binary);
+    std::string error;
+    try { load_profile_image(corrupt); }
+    catch (std::runtime_error const & e) { error = e.what(); }
+    TEST_CHECK_EQUAL(error, "Invalid profile image file");
+    TEST_CHECK_EQUAL(cache.compile(settings), image);
+
+    // Threads storing the same entry don't share a temporary file
+    std::vector<std::thread> writers;
+    for (int i = 0; i < 4; ++i)
+        writers.emplace_back([&] {
+            for (int j = 0; j < 20; ++j)
+                cache.store(hash_keys_settings(settings), image);
+        });
+    for (auto & t: writers)
+        t.join();
+    TEST_CHECK_EQUAL(cache.compile(settings), image);
+
+    // Entry stored under another layout's hash isn't returned
+    lobera_usb::keys_settings other;
+    other.emplace(0x1f, lobera_usb::key_setting(0x16));
+    cache.store(hash_keys_settings(settings), lobera_usb::compile_profile_image(other));
+    TEST_CHECK_EQUAL(cache.compile(settings), image);
+
+    lobera_usb l;
+    l.open();
+    l.write_profile_image(4, image);
+    TEST_CHECK_EQUAL(l.read_profile_image(4), image);
+    l.set_profile_buttons(4, lobera_usb::keys_settings{});
+}
+
+void test_try_decode()
+{
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(lobera_usb::macro{lobera_usb::macro_entry::key_dn(0x04)}));
+    settings.emplace(0x1f, lobera_usb::key_setting(0x16));
+    auto image = lobera_usb::compile_profile_image(settings);
+
+    auto ok = lobera_usb::try_decode_profile_image(image);
+    TEST_CHECK_EQUAL(ok.has_value(), true);
+    TEST_CHECK_EQUAL(*ok, settings);
+
+    auto broken = image;
+    broken.data[0] = 0x99; // macro code
+    auto bad_code = lobera_usb::try_decode_profile_image(broken);
+    TEST_CHECK_EQUAL(bad_code.code(), lobera_errc::UNKNOWN_MACRO_CODE);
+    TEST_CHECK_EQUAL(bad_code.error().detail, 0x99);
+
+    broken = image;
+    broken.repeats[1] = 7; // repeat mode
+    TEST_CHECK_EQUAL(lobera_usb::try_decode_profile_image(broken).code(), lobera_errc::UNKNOWN_REPEAT_MODE);
+
+    broken = image;
+    broken.data.resize(10);
+    TEST_CHECK_EQUAL(lobera_usb::try_decode_profile_image(broken).code(), lobera_errc::INVALID_IMAGE);
+
+    uint8_t cut[] = {0x84, 0x04}; // record missing its last byte
+    auto cut_macro = lobera_codec::try_decode_macro_entries(cut, sizeof(cut));
+    TEST_CHECK_EQUAL(cut_macro.code(), lobera_errc::BROKEN_MACRO);
+    TEST_CHECK_EQUAL(lobera_error_message(cut_macro.error()), std::string("Broken macro data"));
+
+    TEST_CHECK_EQUAL(settings.at(0x1f).try_get_macro().code(), lobera_errc::WRONG_SETTING_TYPE);
+    TEST_CHECK_EQUAL(lobera_error_message(settings.at(0x1f).try_get_macro().error()), std::string("Invalid key setting type"));
+    TEST_CHECK_EQUAL(*settings.at(0x1f).try_get_subst_key(), 0x16);
+}
+
+void test_stream_keys()
+{
+    // Macro records split across the first batch end
+    lobera_usb::macro m;
+    for (size_t i = 0; i < 700; ++i)
+        m.push_back(lobera_usb::macro_entry::sleep(i));
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(m));
+    settings.emplace(0x1f, lobera_usb::key_setting(m, lobera_usb::repeat_mode::PRESS));
+    settings.emplace(0x20, lobera_usb::key_setting(0x16));
+    auto image = lobera_usb::compile_profile_image(settings);
+
+    lobera_codec::keys_stream_encoder encoder(settings);
+    std::vector<uint8_t> data(encoder.num_batches() * BATCH_SIZE);
+    for (size_t p = 0; encoder.next_batch(data.data() + p); p += BATCH_SIZE)
+    {   }
+    TEST_CHECK_EQUAL(data, image.data);
+
+    lobera_codec::keys_stream_decoder decoder;
+    lobera_usb::keys_settings decoded;
+    decoder.reset(lobera_codec::decode_offset_entries(image.offsets.data(), image.offsets.size()),
+                  lobera_codec::decode_repeat_entries(image.repeats.data(), image.repeats.size()),
+                  image.data.size()).value();
+    for (size_t p = 0; !decoder.done(); p += 1000)
+    {
+        decoder.feed(p, image.data.data() + p, std::min<size_t>(1000, image.data.size() - p),
+                     [&](uint8_t key, lobera_usb::key_setting && setting) { decoded.emplace(key, std::move(setting)); }).value();
+    }
+    TEST_CHECK_EQUAL(decoded, settings);
+
+    lobera_usb l;
+    l.open();
+    l.set_profile_buttons(4, settings);
+    decoded.clear();
+    l.read_profile_buttons(4, [&](uint8_t key, lobera_usb::key_setting && setting) { decoded.emplace(key, std::move(setting)); });
+    TEST_CHECK_EQUAL(decoded, settings);
+    l.set_profile_buttons(4, lobera_usb::keys_settings{});
+}
+
+void test_simd()
+{
+    std::vector<uint8_t> a(BATCH_SIZE + 7, 0), b(a);
+    TEST_CHECK_EQUAL(lobera_simd::all_zero(a.data(), a.size()), true);
+    TEST_CHECK_EQUAL(lobera_simd::first_difference(a.data(), b.data(), a.size()), a.size());
+
+    for (size_t pos: {0u, 15u, 16u, 31u, 33u, 1000u, BATCH_SIZE + 6u})
+    {
+        b = a;
+        b[pos] = 0x42;
+        TEST_CHECK_EQUAL(lobera_simd::first_difference(a.data(), b.data(), a.size()), pos);
+        TEST_CHECK_EQUAL(lobera_simd::all_zero(b.data(), b.size()), false);
+        TEST_CHECK_EQUAL(lobera_simd::find_byte(b.data(), b.size(), 0x42), pos);
+    }
+
+    // Zero bytes off the record lattice aren't terminators
+    for (size_t stride: {2u, 3u, 5u})
+    {
+        for (size_t term = 0; term < 300; term += stride)
+        {
+            std::vector<uint8_t> table(575, 0x84);
+            for (size_t i = 1; i < table.size(); i += stride)
+                table[i] = 0;
+            for (size_t i = term; i < table.size(); i += stride)
+                table[i] = 0;
+            TEST_CHECK_EQUAL(lobera_simd::find_zero_record(table.data(), table.size(), stride), term);
+        }
+    }
+}
+
+void test_plan()
+{
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(0x16));
+    auto plan = lobera_usb::plan_profile_buttons(4, settings);
+    TEST_CHECK_EQUAL(plan.transfers.size(), 4u); // offsets, 1 batch, repeats, finalize
+    TEST_CHECK_EQUAL(plan.batches, 1u);
+    TEST_CHECK_EQUAL(plan.bytes_read, 0u);
+
+    for (uint8_t key = 1; key <= 120; ++key)
+        settings.emplace(key, lobera_usb::key_setting(0x16));
+    bool failed = false;
+    try { lobera_usb::plan_profile_buttons(4, settings); }
+    catch (std::runtime_error const &) { failed = true; }
+    TEST_CHECK_EQUAL(failed, true);
+}
+
+void test_audit()
+{
+    lobera_usb::profile_config c4;
+    c4.profile = 4;
+    c4.keys.emplace(0x1e, lobera_usb::key_setting(0x16));
+
+    lobera_usb l;
+    l.open();
+    l.apply_profiles({c4});
+
+    auto devices = lobera_usb::list_devices();
+    TEST_CHECK_EQUAL(devices.empty(), false);
+    lobera_audit_options options;
+    options.explain = true;
+    auto audit = audit_fleet(devices, {c4}, options);
+    TEST_CHECK_EQUAL(audit[0].ok(), true);
+
+    l.set_key(4, 0x1e, lobera_usb::key_setting(0x17));
+    l.close();
+    audit = audit_fleet(devices, {c4}, options);
+    TEST_CHECK_EQUAL(audit[0].drift.size(), 1u);
+    TEST_CHECK_EQUAL(audit[0].drift[0].keys, true);
+    TEST_CHECK_EQUAL(audit[0].drift[0].keys_differ, std::vector<uint8_t>{0x1e});
+
+    // restore
+    l.open();
+    l.set_profile_buttons(4, lobera_usb::keys_settings{});
+}
+
+void test_audit_sim()
+{
+    typedef lobera_usb::macro_entry entry;
+
+    lobera_usb::profile_config c4;
+    c4.profile = 4;
+    c4.keys.emplace(0x1e, lobera_usb::key_setting(0x16));
+    c4.keys.emplace(0x1f, lobera_usb::key_setting(lobera_usb::macro{entry::key_dn(0x04), entry::key_up(0x04)}));
+    c4.thumbs[0] = lobera_usb::macro{entry::key_dn(0x05), entry::key_up(0x05)};
+    auto expected = lobera_usb::fingerprint_profile(c4);
+
+    lobera_sim l;
+    l.apply_profiles({c4});
+    TEST_CHECK_EQUAL(l.read_profile_fingerprint(4) == expected, true);
+
+    // Same content with dead space in the data matches
+    l.set_key(4, 0x1f, lobera_usb::key_setting(lobera_usb::macro{entry::key_dn(0x04), entry::sleep(10), entry::key_up(0x04)}));
+    l.set_key(4, 0x1f, c4.keys.at(0x1f));
+    TEST_CHECK_EQUAL(l.read_profile_fingerprint(4) == expected, true);
+
+    // Key drift
+    l.set_key(4, 0x1e, lobera_usb::key_setting(0x17));
+    auto fp = l.read_profile_fingerprint(4, &expected);
+    TEST_CHECK_EQUAL(fp.tables, expected.tables);
+    TEST_CHECK_EQUAL(fp.data != expected.data, true);
+    TEST_CHECK_EQUAL(fp.thumbs, expected.thumbs);
+
+    // Thumb drift
+    l.set_key(4, 0x1e, lobera_usb::key_setting(0x16));
+    l.set_thumb_macro(4, 1, lobera_usb::macro{});
+    fp = l.read_profile_fingerprint(4, &expected);
+    TEST_CHECK_EQUAL(fp.tables, expected.tables);
+    TEST_CHECK_EQUAL(fp.data, expected.data);
+    TEST_CHECK_EQUAL(fp.thumbs != expected.thumbs, true);
+}
+
+void test_virtual_profiles()
+{
+    lobera_usb l;
+    l.open();
+    uint8_t profile = l.get_profile();
+
+    lobera_virtual_profiles vp(l, lobera_virtual_profiles::policy::LRU, {4, 5});
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+        lobera_virtual_profiles::layout layout;
+        layout.keys.emplace(0x1e, lobera_usb::key_setting(static_cast<uint8_t>(0x16 + i)));
+        vp.define("layout" + std::to_string(i), layout);
+    }
+
+    TEST_CHECK_EQUAL(vp.activate("layout0"), 4);
+    TEST_CHECK_EQUAL(vp.activate("layout1"), 5);
+    TEST_CHECK_EQUAL(vp.activate("layout0"), 4); // resident
+    TEST_CHECK_EQUAL(vp.activate("layout2"), 5); // evicts layout1
+    TEST_CHECK_EQUAL(l.get_profile(), 5);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(5).at(0x1e), lobera_usb::key_setting(0x18));
+    TEST_CHECK_EQUAL(vp.slot_of("layout1"), 0);
+    TEST_CHECK_EQUAL(vp.get_stats().hits, 1u);
+    TEST_CHECK_EQUAL(vp.get_stats().evictions, 1u);
+
+    // restore
+    l.set_profile_buttons(4, lobera_usb::keys_settings{});
+    l.set_profile_buttons(5, lobera_usb::keys_settings{});
+    l.set_profile(profile);
+}
+
+void test_virtual_profiles_sim()
+{
+    std::vector<lobera_virtual_profiles::layout> layouts(3);
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+        for (uint8_t key = 0x04; key < 0x18; ++key)
+            layouts[i].keys.emplace(key, lobera_usb::key_setting(static_cast<uint8_t>(key + i)));
+        layouts[i].thumbs[0] = lobera_usb::macro{lobera_usb::macro_entry::key_dn(0x04 + i)};
+    }
+
+    lobera_sim l;
+    lobera_virtual_profiles vp(l, lobera_virtual_profiles::policy::LFU, {4, 5});
+    vp.define("a", layouts[0]);
+    vp.define("b", layouts[1]);
+    vp.define("c", layouts[2]);
+
+    // LFU: b is used least, c evicts it
+    TEST_CHECK_EQUAL(vp.activate("a"), 4);
+    TEST_CHECK_EQUAL(vp.activate("b"), 5);
+    TEST_CHECK_EQUAL(vp.activate("a"), 4);
+    TEST_CHECK_EQUAL(vp.activate("a"), 4);
+    TEST_CHECK_EQUAL(vp.activate("c"), 5);
+    TEST_CHECK_EQUAL(vp.slot_of("b"), 0);
+    TEST_CHECK_EQUAL(vp.resident(5), std::string("c"));
+    TEST_CHECK_EQUAL(l.get_profile(), 5);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(5), layouts[2].keys);
+    TEST_CHECK_EQUAL(l.get_thumb_macro(5, 1), layouts[2].thumbs[0]);
+    TEST_CHECK_EQUAL(vp.get_stats().hits, 2u);
+    TEST_CHECK_EQUAL(vp.get_stats().misses, 3u);
+    TEST_CHECK_EQUAL(vp.get_stats().evictions, 1u);
+
+    // One changed key is patched into the resident copy
+    layouts[0].keys.at(0x10) = lobera_usb::key_setting(0x30);
+    vp.define("a", layouts[0]);
+    TEST_CHECK_EQUAL(vp.activate("a"), 4);
+    TEST_CHECK_EQUAL(vp.get_stats().patched, 1u);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), layouts[0].keys);
+
+    // Another manager finds both layouts by fingerprint
+    lobera_virtual_profiles vp2(l, lobera_virtual_profiles::policy::LRU, {4, 5});
+    vp2.define("a", layouts[0]);
+    vp2.define("c", layouts[2]);
+    vp2.scan();
+    TEST_CHECK_EQUAL(vp2.slot_of("a"), 4);
+    TEST_CHECK_EQUAL(vp2.slot_of("c"), 5);
+    TEST_CHECK_EQUAL(vp2.activate("c"), 5);
+    TEST_CHECK_EQUAL(vp2.get_stats().hits, 1u);
+
+    // A patch that would make set_key() compact the profile is written whole
+    lobera_virtual_profiles::layout big;
+    for (uint8_t key = 0x04; key < 0x08; ++key)
+        big.keys.emplace(key, lobera_usb::key_setting(lobera_usb::macro(1000, lobera_usb::macro_entry::key_dn(key))));
+    l.set_compaction_threshold(0.1);
+    lobera_virtual_profiles vp3(l, lobera_virtual_profiles::policy::LRU, {3});
+    vp3.define("big", big);
+    vp3.activate("big");
+    big.keys.at(0x04) = lobera_usb::key_setting(lobera_usb::macro(1001, lobera_usb::macro_entry::key_dn(0x04)));
+    vp3.define("big", big);
+    vp3.activate("big");
+    TEST_CHECK_EQUAL(vp3.get_stats().patched, 0u);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(3), big.keys);
+}
+
+void test_profile_store()
+{
+    lobera_usb::macro const m = {
+        lobera_usb::macro_entry::key_dn(0x04),
+        lobera_usb::macro_entry::sleep(50),
+        lobera_usb::macro_entry::key_up(0x04),
+    };
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(m));
+    settings.emplace(0x1f, lobera_usb::key_setting(0x16));
+
+    lobera_profile_store_builder builder;
+    builder.add("gaming", settings, {m, lobera_usb::macro{}, lobera_usb::macro{}});
+    builder.add("default", lobera_usb::keys_settings{});
+    builder.save("/tmp/lobera_test_store");
+
+    lobera_profile_store store("/tmp/lobera_test_store");
+    TEST_CHECK_EQUAL(store.size(), 2u);
+    TEST_CHECK_EQUAL(store.at(0).name, "default");
+
+    lobera_profile_store::entry e, by_hash;
+    TEST_CHECK_EQUAL(store.find("gaming", e), true);
+    TEST_CHECK_EQUAL(store.find("missing", by_hash), false);
+    TEST_CHECK_EQUAL(lobera_profile_store::decode_keys(e), settings);
+    TEST_CHECK_EQUAL(lobera_profile_store::decode_thumb(e, 1), m);
+    TEST_CHECK_EQUAL(store.find_hash(e.hash, by_hash), true);
+    TEST_CHECK_EQUAL(by_hash.name, "gaming");
+
+    lobera_usb l;
+    l.open();
+    store.apply(l, "gaming", 4);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(4), settings);
+    TEST_CHECK_EQUAL(l.get_thumb_macro(4, 1), m);
+    store.apply(l, "default", 4);
+    TEST_CHECK_EQUAL(l.get_thumb_macro(4, 1), lobera_usb::macro{});
+}
+
+void test_mirror()
+{
+    lobera_mirror mirror;
+    lobera_mirror::reader reader(mirror);
+    TEST_CHECK_EQUAL(reader.get().known, 0u);
+
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(0x16));
+
+    lobera_usb l;
+    l.open();
+    uint8_t profile = l.get_profile();
+    l.attach_mirror(&mirror);
+    l.set_profile(4);
+    l.set_profile_buttons(4, settings);
+    l.set_key(4, 0x1f, lobera_usb::key_setting(0x17));
+    settings.emplace(0x1f, lobera_usb::key_setting(0x17));
+    lobera_usb::status status = l.get_status();
+
+    lobera_mirror::snapshot const & s = reader.get();
+    TEST_CHECK_EQUAL(s.profile, 4);
+    TEST_CHECK_EQUAL(s.status, status);
+    TEST_CHECK_EQUAL(*s.keys[3], settings);
+    TEST_CHECK_EQUAL(s.keys[0] == nullptr, true);
+    TEST_CHECK_EQUAL(s.generation, mirror.generation());
+
+    l.set_profile_buttons(4, lobera_usb::keys_settings{});
+    l.attach_mirror(nullptr);
+    TEST_CHECK_EQUAL(mirror.current()->keys[3]->empty(), true);
+    l.set_profile(profile);
+}
+
+void test_mirror_sim()
+{
+    lobera_mirror mirror;
+    lobera_mirror::reader reader(mirror);
+
+    lobera_sim l;
+    l.attach_mirror(&mirror);
+    l.set_profile(3);
+    l.set_profile_color(2, 0x123456);
+    TEST_CHECK_EQUAL(reader.get().profile, 3);
+    TEST_CHECK_EQUAL(reader.get().known & lobera_mirror::snapshot::PROFILE, static_cast<uint32_t>(lobera_mirror::snapshot::PROFILE));
+    TEST_CHECK_EQUAL(reader.get().colors[2], 0x123456u);
+
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(0x16));
+    l.set_profile_buttons(2, settings);
+    TEST_CHECK_EQUAL(*reader.get().keys[1], settings);
+
+    // Snapshots already taken don't change
+    auto held = mirror.current();
+    uint64_t generation = mirror.generation();
+    l.set_key(2, 0x1f, lobera_usb::key_setting(0x17));
+    TEST_CHECK_EQUAL(held->keys[1]->count(0x1f), 0u);
+    TEST_CHECK_EQUAL(reader.get().keys[1]->at(0x1f), lobera_usb::key_setting(0x17));
+    TEST_CHECK_EQUAL(reader.get().generation > generation, true);
+
+    // Bulk write failing part way leaves the keys unknown
+    l.fail_transfers(1);
+    bool failed = false;
+    try { l.set_profile_buttons(2, settings); }
+    catch (std::runtime_error const &) { failed = true; }
+    TEST_CHECK_EQUAL(failed, true);
+    TEST_CHECK_EQUAL(reader.get().keys[1] == nullptr, true);
+
+    // Patching unknown keys publishes nothing
+    l.resume();
+    generation = mirror.generation();
+    l.set_key(2, 0x1e, lobera_usb::key_setting(0x16));
+    TEST_CHECK_EQUAL(mirror.generation(), generation);
+
+    l.get_profile_buttons(2);
+    TEST_CHECK_EQUAL(*reader.get().keys[1], settings);
+}
+
+void test_shared_pacing()
+{
+    // Two handles stand in for two processes, each has its own ledger
+    lobera_usb l1, l2;
+    l1.open();
+    l1.share_pacing("/tmp");
+    l2.open();
+    l2.share_pacing("/tmp");
+
+    uint8_t profile = l1.get_profile();
+    l1.set_profile(4);
+    auto start = std::chrono::steady_clock::now();
+    TEST_CHECK_EQUAL(l2.get_profile(), 4);
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    TEST_CHECK_EQUAL(waited >= 400, true); // W_PROFILE read cool-down
+
+    l1.set_profile(profile);
+}
+
+void test_resume_sim()
+{
+    typedef lobera_usb::macro_entry entry;
+
+    // Keys spanning several data batches, failing in the middle of them
+    lobera_usb::keys_settings settings;
+    for (uint8_t key = 0x04; key < 0x0c; ++key)
+        settings.emplace(key, lobera_usb::key_setting(lobera_usb::macro(1000, entry::key_dn(key))));
+    TEST_CHECK_EQUAL(lobera_usb::plan_profile_buttons(2, settings).batches > 3, true);
+
+    lobera_sim l;
+    l.fail_transfers(3);
+    bool failed = false;
+    try { l.set_profile_buttons(2, settings); }
+    catch (std::runtime_error const &) { failed = true; }
+    TEST_CHECK_EQUAL(failed, true);
+    TEST_CHECK_EQUAL(l.pending_transfers() > 0, true);
+
+    l.resume();
+    TEST_CHECK_EQUAL(l.pending_transfers(), 0u);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(2), settings);
+
+    // Reset failing after its reads, part way through its writes
+    lobera_sim defaults;
+    l.set_thumb_macro(3, 2, lobera_usb::macro{entry::key_dn(0x05), entry::key_up(0x05)});
+    l.set_profile_color(1, 0x123456);
+    l.reset_stats();
+    l.reset_config();
+    size_t reads = l.get_stats().reads;
+    l.set_profile_buttons(2, settings);
+    l.set_thumb_macro(3, 2, lobera_usb::macro{entry::key_dn(0x05), entry::key_up(0x05)});
+    l.set_profile_color(1, 0x123456);
+
+    l.fail_transfers(reads + 1);
+    failed = false;
+    try { l.reset_config(); }
+    catch (std::runtime_error const &) { failed = true; }
+    TEST_CHECK_EQUAL(failed, true);
+    TEST_CHECK_EQUAL(l.pending_transfers() > 0, true);
+
+    l.resume();
+    TEST_CHECK_EQUAL(l.pending_transfers(), 0u);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(2).empty(), true);
+    for (uint8_t profile = 1; profile <= 5; ++profile)
+    {
+        TEST_CHECK_EQUAL(l.memory(profile).thumbs, defaults.memory(profile).thumbs);
+        TEST_CHECK_EQUAL(l.memory(profile).thumb_enabled, defaults.memory(profile).thumb_enabled);
+    }
+    TEST_CHECK_EQUAL(l.get_profile_colors(), defaults.get_profile_colors());
+}
+
 void test_reset_config()
 {
     lobera_usb l;
@@ -181,15 +906,65 @@ void test_reset_config()
     l.reset_config();
 }
 
+void test_reset_config_sim()
+{
+    // Default device: reads only
+    lobera_sim l;
+    l.reset_config();
+    TEST_CHECK_EQUAL(l.get_stats().writes, 0u);
+
+    // One dirty profile: only its blocks are written
+    lobera_usb::keys_settings settings;
+    settings.emplace(0x1e, lobera_usb::key_setting(0x16));
+    l.set_profile_buttons(3, settings);
+    l.set_thumb_macro(3, 1, lobera_usb::macro{lobera_usb::macro_entry::key_dn(0x05), lobera_usb::macro_entry::key_up(0x05)});
+    l.reset_stats();
+    l.reset_config();
+    for (uint8_t profile = 1; profile <= 5; ++profile)
+        TEST_CHECK_EQUAL(l.get_stats().profile_writes[profile - 1] > 0, profile == 3);
+    TEST_CHECK_EQUAL(l.get_profile_buttons(3).empty(), true);
+    TEST_CHECK_EQUAL(l.get_thumb_macro(3, 1).empty(), true);
+
+    // Forced: everything is rewritten
+    l.reset_stats();
+    l.reset_config(true);
+    TEST_CHECK_EQUAL(l.get_stats().writes, lobera_usb::plan_reset_config().transfers.size());
+    for (uint8_t profile = 1; profile <= 5; ++profile)
+        TEST_CHECK_EQUAL(l.get_stats().profile_writes[profile - 1] > 0, true);
+}
+
 int main(int argc, char const *argv[])
 {
     std::vector<std::pair<std::string, std::function<void()>>> tests = {
         TEST_FN(test_set_color),
+        TEST_FN(test_color_stream),
+        TEST_FN(test_color_stream_sim),
         TEST_FN(test_set_profile),
         TEST_FN(test_set_light_mode),
+        TEST_FN(test_watcher),
+        TEST_FN(test_watcher_sim),
         TEST_FN(test_set_macro),
+        TEST_FN(test_macro_entry),
         TEST_FN(test_set_keys),
+        TEST_FN(test_set_key),
+        TEST_FN(test_apply_profiles),
+        TEST_FN(test_apply_profiles_sim),
+        TEST_FN(test_profile_image),
+        TEST_FN(test_try_decode),
+        TEST_FN(test_stream_keys),
+        TEST_FN(test_simd),
+        TEST_FN(test_plan),
+        TEST_FN(test_audit),
+        TEST_FN(test_audit_sim),
+        TEST_FN(test_virtual_profiles),
+        TEST_FN(test_virtual_profiles_sim),
+        TEST_FN(test_profile_store),
+        TEST_FN(test_mirror),
+        TEST_FN(test_mirror_sim),
+        TEST_FN(test_shared_pacing),
+        TEST_FN(test_resume_sim),
         //TEST_FN(test_reset_config),
+        TEST_FN(test_reset_config_sim),
     };
 
     for (auto const & test: tests)